@@ -0,0 +1,245 @@
+#ifndef LUTOK2_ALLOCATOR_H
+#define LUTOK2_ALLOCATOR_H
+
+namespace lutok2 {
+	struct MemoryUsage {
+		size_t live;
+		size_t peak;
+		size_t limit;
+	};
+
+	/*
+		Accounting layer which State installs in front of the actual allocator.
+		It tracks live and peak bytes of a Lua state and enforces optional hard limit - allocation
+		over the limit fails so Lua raises LUA_ERRMEM.
+	*/
+	class AccountingAllocator {
+	public:
+		lua_Alloc allocator;
+		void * userData;
+		MemoryUsage usage;
+
+		AccountingAllocator(lua_Alloc allocator, void * userData){
+			this->allocator = allocator;
+			this->userData = userData;
+			usage.live = 0;
+			usage.peak = 0;
+			usage.limit = 0;
+		}
+
+		static void * alloc(void * userData, void * ptr, size_t osize, size_t nsize){
+			AccountingAllocator * self = static_cast<AccountingAllocator *>(userData);
+			const size_t oldSize = (ptr != nullptr) ? osize : 0;
+			MemoryUsage & usage = self->usage;
+
+			if (usage.limit > 0 && nsize > oldSize && usage.live + (nsize - oldSize) > usage.limit){
+				return nullptr;
+			}
+			void * block = self->allocator(self->userData, ptr, osize, nsize);
+			if (block != nullptr || nsize == 0){
+				usage.live = usage.live - oldSize + nsize;
+				if (usage.live > usage.peak){
+					usage.peak = usage.live;
+				}
+			}
+			return block;
+		}
+
+		// the same allocator luaL_newstate uses
+		static void * defaultAlloc(void * userData, void * ptr, size_t osize, size_t nsize){
+			LUTOK2_NOT_USED(userData);
+			LUTOK2_NOT_USED(osize);
+			if (nsize == 0){
+				free(ptr);
+				return nullptr;
+			}
+			return realloc(ptr, nsize);
+		}
+
+		/*
+			Returns accounting layer of Lua state or nullptr if the state wasn't created by State.
+		*/
+		static AccountingAllocator * get(lua_State * L){
+			void * userData = nullptr;
+			if (lua_getallocf(L, &userData) == alloc){
+				return static_cast<AccountingAllocator *>(userData);
+			}
+			return nullptr;
+		}
+	};
+
+	/*
+		Size-class pool allocator for Lua states
+
+		Small blocks (up to maxPooledSize bytes) are carved from larger chunks and recycled
+		through per-class free lists, bigger blocks are passed to realloc/free.
+		One instance should serve exactly one Lua state - it's not thread-safe.
+
+		Usage:
+			PoolAllocator allocator;
+			State state(PoolAllocator::alloc, &allocator);
+	*/
+	class PoolAllocator {
+	public:
+		static const size_t granularity = 16;
+		static const size_t classCount = 32;
+		static const size_t maxPooledSize = granularity * classCount;
+		static const size_t defaultChunkSize = 64 * 1024;
+
+		struct Stats {
+			size_t live;
+			size_t peak;
+			size_t limit;
+			size_t reserved;
+			size_t failed;
+			// the last item counts allocations of blocks bigger than maxPooledSize
+			size_t allocations[classCount + 1];
+		};
+	private:
+		struct FreeBlock {
+			FreeBlock * next;
+		};
+
+		FreeBlock * freeLists[classCount];
+		std::vector<void *> chunks;
+		char * chunkCursor;
+		char * chunkEnd;
+		size_t chunkSize;
+		Stats stats;
+
+		static inline size_t sizeClass(const size_t size){
+			return (size + granularity - 1) / granularity - 1;
+		}
+
+		void * allocateBlock(const size_t size){
+			if (size > maxPooledSize){
+				stats.allocations[classCount]++;
+				return malloc(size);
+			}
+			const size_t index = sizeClass(size);
+			stats.allocations[index]++;
+
+			FreeBlock * block = freeLists[index];
+			if (block != nullptr){
+				freeLists[index] = block->next;
+				return block;
+			}
+
+			const size_t blockSize = (index + 1) * granularity;
+			if (chunkCursor == nullptr || static_cast<size_t>(chunkEnd - chunkCursor) < blockSize){
+				char * chunk = static_cast<char *>(malloc(chunkSize));
+				if (chunk == nullptr){
+					return nullptr;
+				}
+				chunks.push_back(chunk);
+				stats.reserved += chunkSize;
+				// remaining space of the previous chunk is too small for this class, recycle it for smaller ones
+				while (chunkCursor != nullptr && static_cast<size_t>(chunkEnd - chunkCursor) >= granularity){
+					size_t restSize = static_cast<size_t>(chunkEnd - chunkCursor) / granularity * granularity;
+					if (restSize > maxPooledSize){
+						restSize = maxPooledSize;
+					}
+					releaseBlock(chunkCursor, restSize);
+					chunkCursor += restSize;
+				}
+				chunkCursor = chunk;
+				chunkEnd = chunk + chunkSize;
+			}
+			void * result = chunkCursor;
+			chunkCursor += blockSize;
+			return result;
+		}
+
+		void releaseBlock(void * ptr, const size_t size){
+			if (size > maxPooledSize){
+				free(ptr);
+			}else{
+				const size_t index = sizeClass(size);
+				FreeBlock * block = static_cast<FreeBlock *>(ptr);
+				block->next = freeLists[index];
+				freeLists[index] = block;
+			}
+		}
+
+	public:
+		explicit PoolAllocator(const size_t limit = 0, const size_t chunkSize = defaultChunkSize){
+			for (size_t i = 0; i < classCount; i++){
+				freeLists[i] = nullptr;
+			}
+			memset(&stats, 0, sizeof(stats));
+			stats.limit = limit;
+			chunkCursor = nullptr;
+			chunkEnd = nullptr;
+			this->chunkSize = (chunkSize > maxPooledSize) ? (chunkSize / granularity * granularity) : maxPooledSize;
+		}
+
+		~PoolAllocator(){
+			for (std::vector<void *>::iterator iter = chunks.begin(); iter != chunks.end(); iter++){
+				free(*iter);
+			}
+		}
+
+		/*
+			lua_Alloc compatible entry point, userData must point to PoolAllocator instance.
+		*/
+		static void * alloc(void * userData, void * ptr, size_t osize, size_t nsize){
+			return static_cast<PoolAllocator *>(userData)->reallocate(ptr, osize, nsize);
+		}
+
+		void * reallocate(void * ptr, size_t osize, size_t nsize){
+			if (ptr == nullptr){
+				osize = 0;
+			}
+			if (nsize == 0){
+				if (ptr != nullptr){
+					releaseBlock(ptr, osize);
+					stats.live -= osize;
+				}
+				return nullptr;
+			}
+			if (stats.limit > 0 && nsize > osize && stats.live + (nsize - osize) > stats.limit){
+				stats.failed++;
+				return nullptr;
+			}
+
+			void * block = nullptr;
+			if (ptr != nullptr && osize <= maxPooledSize && nsize <= maxPooledSize && sizeClass(osize) == sizeClass(nsize)){
+				block = ptr;
+			}else if (ptr != nullptr && osize > maxPooledSize && nsize > maxPooledSize){
+				stats.allocations[classCount]++;
+				block = realloc(ptr, nsize);
+			}else{
+				block = allocateBlock(nsize);
+				if (block != nullptr && ptr != nullptr){
+					memcpy(block, ptr, (osize < nsize) ? osize : nsize);
+					releaseBlock(ptr, osize);
+				}
+			}
+
+			if (block == nullptr){
+				stats.failed++;
+				// Lua expects that shrinking a block never fails
+				if (nsize <= osize){
+					block = ptr;
+				}else{
+					return nullptr;
+				}
+			}
+			stats.live = stats.live - osize + nsize;
+			if (stats.live > stats.peak){
+				stats.peak = stats.live;
+			}
+			return block;
+		}
+
+		const Stats & getStats() const {
+			return stats;
+		}
+
+		void setLimit(const size_t limit){
+			stats.limit = limit;
+		}
+	};
+};
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef LUTOK2_BINDING_H
+#define LUTOK2_BINDING_H
+
+namespace lutok2 {
+	/*
+		Compile-time typed bindings
+
+		Parameter and return types are deduced from function signature and every signature
+		gets its own lua_CFunction which reads arguments and pushes results with StackValue.
+	*/
+
+#define LUTOK_FUNCTION(FN) (&lutok2::FunctionBinding<decltype(FN)>::template call<FN>)
+#define LUTOK_BIND_METHOD(KEY, METHOD_FN) methods[(KEY)] = static_cast<Method>(&std::remove_reference<decltype(*this)>::type::template boundMethod<decltype(METHOD_FN), METHOD_FN>);
+#define LUTOK_BIND_PROPERTY(KEY, GETTER_FN, SETTER_FN) properties[(KEY)] = PropertyPair(\
+	static_cast<Method>(&std::remove_reference<decltype(*this)>::type::template boundGetter<decltype(GETTER_FN), GETTER_FN>),\
+	static_cast<Method>(&std::remove_reference<decltype(*this)>::type::template boundSetter<decltype(SETTER_FN), SETTER_FN>));
+
+	template<int... Is> struct Indices {};
+	template<int N, int... Is> struct BuildIndices : BuildIndices<N - 1, N - 1, Is...> {};
+	template<int... Is> struct BuildIndices<0, Is...> {
+		typedef Indices<Is...> type;
+	};
+
+	template<typename T> struct Argument {
+		typedef StackValue<typename std::decay<T>::type> type;
+	};
+
+	/*
+		Calls a callable and pushes its return value (if any), returns the number of results
+	*/
+	template<typename R> struct ResultValue {
+		template<typename F> static inline int call(lua_State * L, const F & fn){
+			StackValue<typename std::decay<R>::type>::push(L, fn());
+			return 1;
+		}
+	};
+
+	template<> struct ResultValue<void> {
+		template<typename F> static inline int call(lua_State * L, const F & fn){
+			LUTOK2_NOT_USED(L);
+			fn();
+			return 0;
+		}
+	};
+
+	/*
+		Calls a callable converting C++ exceptions into Lua errors
+	*/
+	template<typename R, typename F> static inline int protectedCall(lua_State * L, const F & fn){
+		try{
+			return ResultValue<R>::call(L, fn);
+		}
+		catch (const std::exception & e){
+			luaL_where(L, 1);
+			lua_pushfstring(L, "Unhandled exception: %s", e.what());
+			lua_concat(L, 2);
+		}
+		return lua_error(L);
+	}
+
+	template<typename R, typename... Args> struct FunctionBinding<R (*)(Args...)> {
+		typedef R (*FunctionType)(Args...);
+		typedef typename BuildIndices<sizeof...(Args)>::type ArgumentIndices;
+
+		template<int... Is> static inline int invoke(lua_State * L, FunctionType fn, Indices<Is...>){
+			return protectedCall<R>(L, [=]() -> R {
+				return fn(Argument<Args>::type::get(L, Is + 1)...);
+			});
+		}
+
+		// function pointer is known at compile time - no upvalues needed
+		template<FunctionType fn> static int call(lua_State * L){
+			return invoke(L, fn, ArgumentIndices());
+		}
+
+		// function pointer is stored in the first upvalue (see Stack::bind)
+		static int callUpvalue(lua_State * L){
+			FunctionType * fn = static_cast<FunctionType *>(lua_touserdata(L, lua_upvalueindex(1)));
+			return invoke(L, *fn, ArgumentIndices());
+		}
+	};
+
+	/*
+		Member functions - arguments start after the object itself
+	*/
+	template<typename M> struct MethodBinding;
+
+	template<class C, typename R, typename... Args> struct MethodBinding<R (C::*)(Args...)> {
+		typedef R (C::*MethodType)(Args...);
+		typedef typename BuildIndices<sizeof...(Args)>::type ArgumentIndices;
+
+		template<int... Is> static inline int invoke(lua_State * L, C * object, MethodType method, const int first, Indices<Is...>){
+			return protectedCall<R>(L, [=]() -> R {
+				return (object->*method)(Argument<Args>::type::get(L, Is + first)...);
+			});
+		}
+	};
+
+	template<class C, typename R, typename... Args> struct MethodBinding<R (C::*)(Args...) const> {
+		typedef R (C::*MethodType)(Args...) const;
+		typedef typename BuildIndices<sizeof...(Args)>::type ArgumentIndices;
+
+		template<int... Is> static inline int invoke(lua_State * L, C * object, MethodType method, const int first, Indices<Is...>){
+			return protectedCall<R>(L, [=]() -> R {
+				return (object->*method)(Argument<Args>::type::get(L, Is + first)...);
+			});
+		}
+	};
+};
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef LUTOK2_BUFFER_H
+#define LUTOK2_BUFFER_H
+
+namespace lutok2 {
+	/*
+		Typed numeric array shared by C++ and Lua
+
+		Buffers created from Lua keep their items in the same userdata block as the Buffer itself.
+		Wrapped buffers only point to external memory, which must outlive the Lua object.
+	*/
+	template<typename T> class Buffer {
+	public:
+		T * data;
+		size_t length;
+		bool external;
+
+		Buffer(T * data, const size_t length, const bool external) : data(data), length(length), external(external){
+		}
+
+		/*
+			Bulk operations - plain loops with independent accumulators, so compilers can vectorize them
+		*/
+		void fill(const T value){
+			T * __restrict out = data;
+			for (size_t i = 0; i < length; i++){
+				out[i] = value;
+			}
+		}
+
+		// copies min(length, source.length) items
+		void copy(const Buffer<T> & source){
+			const size_t count = (source.length < length) ? source.length : length;
+			memmove(data, source.data, count * sizeof(T));
+		}
+
+		void scale(const T factor){
+			T * __restrict out = data;
+			for (size_t i = 0; i < length; i++){
+				out[i] = out[i] * factor;
+			}
+		}
+
+		double sum() const {
+			const T * __restrict in = data;
+			double partial[4] = {0.0, 0.0, 0.0, 0.0};
+			size_t i = 0;
+			for (; i + 4 <= length; i += 4){
+				partial[0] += in[i];
+				partial[1] += in[i + 1];
+				partial[2] += in[i + 2];
+				partial[3] += in[i + 3];
+			}
+			for (; i < length; i++){
+				partial[0] += in[i];
+			}
+			return (partial[0] + partial[1]) + (partial[2] + partial[3]);
+		}
+
+		// dot product of the first min(length, other.length) items
+		double dot(const Buffer<T> & other) const {
+			const T * __restrict a = data;
+			const T * __restrict b = other.data;
+			const size_t count = (other.length < length) ? other.length : length;
+			double partial[4] = {0.0, 0.0, 0.0, 0.0};
+			size_t i = 0;
+			for (; i + 4 <= count; i += 4){
+				partial[0] += static_cast<double>(a[i]) * b[i];
+				partial[1] += static_cast<double>(a[i + 1]) * b[i + 1];
+				partial[2] += static_cast<double>(a[i + 2]) * b[i + 2];
+				partial[3] += static_cast<double>(a[i + 3]) * b[i + 3];
+			}
+			for (; i < count; i++){
+				partial[0] += static_cast<double>(a[i]) * b[i];
+			}
+			return (partial[0] + partial[1]) + (partial[2] + partial[3]);
+		}
+	};
+
+	/*
+		Lua interface of Buffer<T>
+
+		buffer(n) creates a zero-filled buffer of n items, buffer{...} creates a buffer from table items.
+		Items are accessed with 1-based indexes (buf[i]), #buf returns the number of items.
+		Methods: fill(value), copy(source), sum(), scale(factor), dot(other), toTable()
+	*/
+	template<typename T> class LuaBuffer : public Object<Buffer<T>> {
+	public:
+		typedef Object<Buffer<T>> Base;
+		typedef typename Base::Method Method;
+
+		explicit LuaBuffer(State * state) : Base(state){
+			this->methods["fill"] = static_cast<Method>(&LuaBuffer::fill);
+			this->methods["copy"] = static_cast<Method>(&LuaBuffer::copy);
+			this->methods["sum"] = static_cast<Method>(&LuaBuffer::sum);
+			this->methods["scale"] = static_cast<Method>(&LuaBuffer::scale);
+			this->methods["dot"] = static_cast<Method>(&LuaBuffer::dot);
+			this->methods["toTable"] = static_cast<Method>(&LuaBuffer::toTable);
+		}
+
+		/*
+			The largest buffer length - the userdata size must not overflow and lengths are passed to Lua as int
+		*/
+		static inline size_t maxLength(){
+			const size_t limit = Base::maxExtraSize() / sizeof(T);
+			return (limit < static_cast<size_t>(INT_MAX)) ? limit : static_cast<size_t>(INT_MAX);
+		}
+
+		/*
+			Pushes a new buffer of length items into stack
+		*/
+		Buffer<T> * create(const size_t length){
+			if (length > maxLength()){
+				luaL_error(this->luaState, "Buffer length %f exceeds the maximum of %d", static_cast<double>(length), static_cast<int>(maxLength()));
+				return nullptr;
+			}
+			Buffer<T> * buffer = this->emplaceSized(length * sizeof(T), nullptr, length, false);
+			buffer->data = static_cast<T *>(Base::trailingStorage(buffer));
+			memset(buffer->data, 0, length * sizeof(T));
+			return buffer;
+		}
+
+		/*
+			Pushes a buffer referring to external memory into stack, no data are copied.
+			The memory must remain valid while Lua can access the buffer.
+		*/
+		Buffer<T> * wrap(T * data, const size_t length){
+			return this->emplace(data, length, true);
+		}
+
+		Buffer<T> * constructor(State & state, bool & managed){
+			LUTOK2_NOT_USED(managed);
+			Stack * stack = state.stack;
+			if (stack->is<LUA_TTABLE>(1)){
+				const size_t length = stack->objLen(1);
+				if (length > maxLength()){
+					state.error("Buffer length must not exceed %d", static_cast<int>(maxLength()));
+					return nullptr;
+				}
+				Buffer<T> * buffer = create(length);
+				for (size_t i = 0; i < length; i++){
+					lua_rawgeti(state.state, 1, static_cast<int>(i + 1));
+					buffer->data[i] = StackValue<T>::get(state.state, -1);
+					stack->pop(1);
+				}
+				return buffer;
+			}else{
+				const lua_Integer length = stack->to<lua_Integer>(1);
+				if (length < 0){
+					state.error("Buffer length must not be negative");
+					return nullptr;
+				}
+				if (static_cast<unsigned long long>(length) > static_cast<unsigned long long>(maxLength())){
+					state.error("Buffer length must not exceed %d", static_cast<int>(maxLength()));
+					return nullptr;
+				}
+				return create(static_cast<size_t>(length));
+			}
+		}
+
+		int operator_len(State & state, Buffer<T> * buffer){
+			state.stack->push<lua_Integer>(static_cast<lua_Integer>(buffer->length));
+			return 1;
+		}
+
+		int operator_getArray(State & state, Buffer<T> * buffer){
+			const lua_Integer index = state.stack->to<lua_Integer>(1);
+			if (index >= 1 && static_cast<size_t>(index) <= buffer->length){
+				StackValue<T>::push(state.state, buffer->data[index - 1]);
+				return 1;
+			}
+			return 0;
+		}
+
+		void operator_setArray(State & state, Buffer<T> * buffer){
+			const lua_Integer index = state.stack->to<lua_Integer>(1);
+			if (index >= 1 && static_cast<size_t>(index) <= buffer->length){
+				buffer->data[index - 1] = StackValue<T>::get(state.state, 2);
+			}else{
+				state.error("Buffer index %d out of range (1..%d)", static_cast<int>(index), static_cast<int>(buffer->length));
+			}
+		}
+
+		int fill(State & state, Buffer<T> * buffer){
+			buffer->fill(StackValue<T>::get(state.state, 1));
+			return 0;
+		}
+
+		int copy(State & state, Buffer<T> * buffer){
+			Buffer<T> * source = this->get(1);
+			if (source == nullptr){
+				state.error("Buffer copy expects a buffer of the same type");
+				return 0;
+			}
+			buffer->copy(*source);
+			return 0;
+		}
+
+		int sum(State & state, Buffer<T> * buffer){
+			state.stack->push<LUA_NUMBER>(static_cast<LUA_NUMBER>(buffer->sum()));
+			return 1;
+		}
+
+		int scale(State & state, Buffer<T> * buffer){
+			buffer->scale(StackValue<T>::get(state.state, 1));
+			return 0;
+		}
+
+		int dot(State & state, Buffer<T> * buffer){
+			Buffer<T> * other = this->get(1);
+			if (other == nullptr){
+				state.error("Buffer dot expects a buffer of the same type");
+				return 0;
+			}
+			state.stack->push<LUA_NUMBER>(static_cast<LUA_NUMBER>(buffer->dot(*other)));
+			return 1;
+		}
+
+		int toTable(State & state, Buffer<T> * buffer){
+			const int length = static_cast<int>(buffer->length);
+			state.stack->newTable(length, 0);
+			for (int i = 0; i < length; i++){
+				StackValue<T>::push(state.state, buffer->data[i]);
+				lua_rawseti(state.state, -2, i + 1);
+			}
+			return 1;
+		}
+	};
+
+	typedef LuaBuffer<float> LuaBufferF32;
+	typedef LuaBuffer<double> LuaBufferF64;
+	typedef LuaBuffer<int32_t> LuaBufferI32;
+	typedef LuaBuffer<uint32_t> LuaBufferU32;
+	typedef LuaBuffer<int16_t> LuaBufferI16;
+	typedef LuaBuffer<uint16_t> LuaBufferU16;
+	typedef LuaBuffer<int8_t> LuaBufferI8;
+	typedef LuaBuffer<uint8_t> LuaBufferU8;
+};
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef LUTOK2_CHUNKCACHE_H
+#define LUTOK2_CHUNKCACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#	include <process.h>
+#else
+#	include <unistd.h>
+#endif
+#include <fstream>
+#include <mutex>
+#include <atomic>
+#include <thread>
+
+namespace lutok2 {
+	/*
+		Compiled chunk cache
+
+		Keeps lua_dump bytecode of loaded scripts in memory and optionally in a cache directory.
+		Files are keyed by path, device, inode, modification time in nanoseconds (seconds on Windows) and size, strings by content hash.
+		Cached bytecode is loaded with luaL_loadbuffer, invalid or missing entries fall back to Lua source.
+		One cache can be shared by many states (and threads).
+
+		Bytecode is not verified by Lua - cache directory must not be writable by untrusted users.
+	*/
+	class ChunkCache {
+	private:
+		std::string directory;
+		std::unordered_map<std::string, std::string> chunks;
+		std::mutex mutex;
+		std::atomic<size_t> hits;
+		std::atomic<size_t> misses;
+
+		static uint64_t hash(const char * data, const size_t length){
+			uint64_t value = 14695981039346656037ULL;
+			for (size_t i = 0; i < length; i++){
+				value ^= static_cast<unsigned char>(data[i]);
+				value *= 1099511628211ULL;
+			}
+			return value;
+		}
+
+		static const std::string hex(const uint64_t value){
+			char buffer[17];
+			snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(value));
+			return std::string(buffer, 16);
+		}
+
+		static uint64_t processId(){
+#if defined(_WIN32)
+			return static_cast<uint64_t>(_getpid());
+#else
+			return static_cast<uint64_t>(getpid());
+#endif
+		}
+
+		// sub-second part of modification time, files edited twice in one second get different keys
+		static long long modificationNanoseconds(const struct stat & fileStat){
+#if defined(__APPLE__)
+			return static_cast<long long>(fileStat.st_mtimespec.tv_nsec);
+#elif defined(_WIN32)
+			LUTOK2_NOT_USED(fileStat);
+			return 0;
+#else
+			return static_cast<long long>(fileStat.st_mtim.tv_nsec);
+#endif
+		}
+
+		const std::string cachePath(const std::string & key){
+			return directory + "/" + hex(hash(key.c_str(), key.length())) + ".luac";
+		}
+
+		bool lookup(const std::string & key, std::string & bytecode){
+			std::lock_guard<std::mutex> lock(mutex);
+			std::unordered_map<std::string, std::string>::const_iterator iter = chunks.find(key);
+			if (iter != chunks.end()){
+				bytecode = iter->second;
+				return true;
+			}
+			if (!directory.empty()){
+				// cache file starts with the full key to rule out hash collisions
+				std::ifstream file(cachePath(key).c_str(), std::ios::in | std::ios::binary);
+				std::string storedKey;
+				if (file && std::getline(file, storedKey) && storedKey == key){
+					bytecode.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+					chunks[key] = bytecode;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void store(const std::string & key, const std::string & bytecode){
+			std::lock_guard<std::mutex> lock(mutex);
+			chunks[key] = bytecode;
+			if (!directory.empty()){
+				// write into a temporary file first so other readers never see a partial entry,
+				// its name is unique for each process and thread sharing the cache directory
+				const std::string path = cachePath(key);
+				const std::string tmpPath = path + "." + hex(processId()) + "." + hex(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+				std::ofstream file(tmpPath.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+				if (file){
+					file << key << '\n';
+					file.write(bytecode.data(), static_cast<std::streamsize>(bytecode.length()));
+					file.close();
+					if (!file || std::rename(tmpPath.c_str(), path.c_str()) != 0){
+						std::remove(tmpPath.c_str());
+					}
+				}
+			}
+		}
+
+		bool loadBytecode(State & state, const std::string & bytecode, const std::string & chunkName){
+			if (luaL_loadbuffer(state.state, bytecode.data(), bytecode.length(), chunkName.c_str()) == 0){
+				return true;
+			}
+			state.stack->pop(1);
+			return false;
+		}
+
+		void loadCached(State & state, const std::string & key, const std::string & chunkName, const std::function<void()> & loadSource){
+			std::string bytecode;
+			if (lookup(key, bytecode) && loadBytecode(state, bytecode, chunkName)){
+				hits++;
+				return;
+			}
+			misses++;
+			loadSource();
+			store(key, state.stack->dumpFunction(-1));
+		}
+	public:
+		/*
+			directory - existing directory for bytecode files, empty string means in-memory cache only
+		*/
+		explicit ChunkCache(const std::string & directory = "") : hits(0), misses(0){
+			this->directory = directory;
+		}
+
+		void loadFile(State & state, const std::string & fileName){
+			struct stat fileStat;
+			if (stat(fileName.c_str(), &fileStat) != 0){
+				// let the regular loader report the error
+				state.loadFile(fileName);
+				return;
+			}
+			const std::string key = "file:" + fileName + ":" + std::to_string(static_cast<unsigned long long>(fileStat.st_dev)) + ":" + std::to_string(static_cast<unsigned long long>(fileStat.st_ino))
+				+ ":" + std::to_string(static_cast<long long>(fileStat.st_mtime)) + "." + std::to_string(modificationNanoseconds(fileStat)) + ":" + std::to_string(static_cast<long long>(fileStat.st_size));
+			loadCached(state, key, "@" + fileName, [&](){
+				state.loadFile(fileName);
+			});
+		}
+
+		void loadString(State & state, const std::string & chunk, const std::string & chunkName = ""){
+			const std::string key = "string:" + chunkName + ":" + hex(hash(chunk.c_str(), chunk.length())) + ":" + std::to_string(static_cast<unsigned long long>(chunk.length()));
+			loadCached(state, key, chunkName, [&](){
+				state.loadString(chunk, chunkName);
+			});
+		}
+
+		void clear(){
+			std::lock_guard<std::mutex> lock(mutex);
+			chunks.clear();
+		}
+
+		size_t getHits() const {
+			return hits;
+		}
+
+		size_t getMisses() const {
+			return misses;
+		}
+	};
+};
+
+#endif
@@ -3,8 +3,16 @@
 
 #include <lua.hpp>
 #include <cassert>
+#include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <climits>
 #include <string>
 #include <exception>
+#include <new>
+#include <stdexcept>
 #include <unordered_map>
 #include <vector>
 #include <utility>
@@ -12,5 +20,9 @@
 #include <tuple>
 #include <type_traits>
 #include <typeinfo>
+#include <atomic>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,369 @@
+#ifndef LUTOK2_COROUTINE_H
+#define LUTOK2_COROUTINE_H
+
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <memory>
+
+namespace lutok2 {
+	/*
+		Lua coroutine driven from C++
+
+		The coroutine thread is referenced from Lua registry, so it isn't collected while the Coroutine exists.
+		Values are exchanged through the coroutine stack (getState()) - resume takes arguments from its top
+		and leaves yielded values, returned values or error message there.
+		Coroutine must not outlive its Lua state.
+	*/
+	class Coroutine {
+	private:
+		State thread;
+		int threadRef;
+		int status;
+		bool started;
+		bool running;
+
+		Coroutine(const Coroutine &);
+		Coroutine & operator= (const Coroutine &);
+	public:
+		/*
+			Creates a coroutine of the function at stack index -(nargs+1), the function and nargs arguments
+			above it are moved into the coroutine stack, so the first call is resume(nargs).
+		*/
+		explicit Coroutine(State & state, const int nargs = 0) : thread(lua_newthread(state.state), false){
+			threadRef = luaL_ref(state.state, LUA_REGISTRYINDEX);
+			lua_xmove(state.state, thread.state, nargs + 1);
+			status = 0;
+			started = false;
+			running = false;
+		}
+
+		~Coroutine(){
+			// registry is shared by all threads, the creating thread may be gone already
+			luaL_unref(thread.state, LUA_REGISTRYINDEX, threadRef);
+		}
+
+		/*
+			Resumes the coroutine with nargs values from the top of the coroutine stack.
+			Returns LUA_YIELD if the coroutine yielded, 0 if it finished or Lua error code.
+		*/
+		int resume(const int nargs = 0){
+			if (running || isDone()){
+				lua_pop(thread.state, nargs);
+				lua_pushstring(thread.state, (running) ? "cannot resume running coroutine" : "cannot resume dead coroutine");
+				return LUA_ERRRUN;
+			}
+			started = true;
+			running = true;
+			status = lua_resume(thread.state, nargs);
+			running = false;
+			return status;
+		}
+
+		// status of the last resume
+		inline int getStatus() const {
+			return status;
+		}
+
+		inline bool isRunning() const {
+			return running;
+		}
+
+		inline bool isSuspended() const {
+			return !running && status == LUA_YIELD;
+		}
+
+		inline bool isDone() const {
+			return started && !running && status != LUA_YIELD;
+		}
+
+		// State view of the coroutine thread
+		inline State & getState(){
+			return thread;
+		}
+
+		// number of values yielded or returned by the last resume
+		inline int getResultCount() const {
+			return lua_gettop(thread.state);
+		}
+
+		/*
+			Call stack of the coroutine - where it's suspended or where it raised an error
+		*/
+		Traceback traceback(const int maxDepth = Traceback::defaultDepth){
+			return Traceback::capture(thread.state, 0, maxDepth);
+		}
+	};
+
+	/*
+		Runs many coroutines on one Lua state
+
+		A bound C++ function running inside a scheduled coroutine can suspend it until an operation completes:
+
+			Scheduler::Ticket ticket = scheduler.park(state);
+			startOperation([&scheduler, ticket](int result){
+				scheduler.complete(ticket, [result](State & state){
+					state.stack->push<int>(result);
+					return 1;
+				});
+			});
+			return scheduler.yield(state);
+
+		complete() may be called from any thread. Completions are applied by poll(), wait() or run() on the thread
+		which uses the Lua state. Coroutines which yield without parking (coroutine.yield() in Lua) are resumed on the next poll.
+		As usual in Lua 5.1, a coroutine can't yield across pcall, metamethods or iterators implemented in C.
+	*/
+	class Scheduler {
+	public:
+		typedef uint64_t Ticket;
+		/*
+			Pushes values returned to the parked coroutine into its stack and returns their number.
+			A negative number means the operation isn't complete yet, the coroutine stays parked.
+		*/
+		typedef std::function<int(State &)> Completion;
+		// called with finished coroutine and status of its last resume (0 or Lua error code)
+		typedef std::function<void(Coroutine &, int)> Finished;
+	private:
+		struct Task {
+			Coroutine coroutine;
+			Finished finished;
+			Ticket ticket;
+
+			Task(State & state, const int nargs, const Finished & finished) : coroutine(state, nargs), finished(finished), ticket(0){
+			}
+		};
+
+		typedef std::unordered_map<lua_State *, std::unique_ptr<Task>> TaskMap;
+		typedef std::unordered_map<Ticket, Task *> TicketMap;
+		typedef std::deque<std::pair<Ticket, Completion>> CompletionQueue;
+
+		State * state;
+		TaskMap tasks;
+		TicketMap parked;
+		std::vector<Task *> ready;
+		Ticket nextTicket;
+
+		std::mutex mutex;
+		std::condition_variable condition;
+		CompletionQueue completions;
+		std::function<void()> notifier;
+
+		Scheduler(const Scheduler &);
+		Scheduler & operator= (const Scheduler &);
+
+		static inline void * schedulerKey(){
+			static char key = 0;
+			return &key;
+		}
+
+		void resumeTask(Task * task, const int nargs){
+			Coroutine & coroutine = task->coroutine;
+			const int status = coroutine.resume(nargs);
+			if (status == LUA_YIELD){
+				if (task->ticket == 0){
+					ready.push_back(task);
+				}
+				return;
+			}
+			if (task->ticket != 0){
+				parked.erase(task->ticket);
+			}
+			if (task->finished){
+				task->finished(coroutine, status);
+			}
+			tasks.erase(coroutine.getState().state);
+		}
+	public:
+		explicit Scheduler(State & state) : state(&state), nextTicket(1){
+			lua_pushlightuserdata(state.state, schedulerKey());
+			lua_pushlightuserdata(state.state, this);
+			lua_rawset(state.state, LUA_REGISTRYINDEX);
+		}
+
+		~Scheduler(){
+			lua_pushlightuserdata(state->state, schedulerKey());
+			lua_pushnil(state->state);
+			lua_rawset(state->state, LUA_REGISTRYINDEX);
+		}
+
+		/*
+			Returns the scheduler of a Lua state (or of its coroutine), nullptr if there's none
+		*/
+		static Scheduler * get(lua_State * L){
+			lua_pushlightuserdata(L, schedulerKey());
+			lua_rawget(L, LUA_REGISTRYINDEX);
+			Scheduler * scheduler = static_cast<Scheduler *>(lua_touserdata(L, -1));
+			lua_pop(L, 1);
+			return scheduler;
+		}
+
+		/*
+			Starts a coroutine of the function at stack index -(nargs+1) with nargs arguments above it
+			and runs it until it yields or finishes
+		*/
+		void spawn(const int nargs = 0, const Finished & finished = Finished()){
+			spawn(*state, nargs, finished);
+		}
+
+		/*
+			Same as above with the function taken from the stack of a coroutine, e.g. when called from a bound function
+		*/
+		void spawn(State & state, const int nargs, const Finished & finished = Finished()){
+			std::unique_ptr<Task> task(new Task(state, nargs, finished));
+			Task * current = task.get();
+			tasks[current->coroutine.getState().state] = std::move(task);
+			resumeTask(current, nargs);
+		}
+
+		/*
+			Marks the coroutine running state (a bound function) as waiting for a completion of the returned ticket.
+			The function should return yield(state) right away.
+		*/
+		Ticket park(State & state){
+			TaskMap::iterator iter = tasks.find(state.state);
+			if (iter == tasks.end()){
+				state.error("Scheduler::park called outside of a scheduled coroutine");
+				return 0;
+			}
+			Task * task = iter->second.get();
+			if (task->ticket == 0){
+				task->ticket = nextTicket++;
+				parked[task->ticket] = task;
+			}
+			return task->ticket;
+		}
+
+		inline int yield(State & state, const int nresults = 0){
+			return lua_yield(state.state, nresults);
+		}
+
+		/*
+			Queues completion of a parked coroutine, thread-safe
+		*/
+		void complete(const Ticket ticket, const Completion & completion = Completion()){
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				completions.push_back(std::make_pair(ticket, completion));
+			}
+			condition.notify_one();
+			if (notifier){
+				notifier();
+			}
+		}
+
+		/*
+			Resumes a parked coroutine right away, must be called on the thread which uses the Lua state.
+			Completion of a coroutine which didn't yield yet is queued. Returns false for unknown tickets
+			and when the completion left the coroutine parked.
+		*/
+		bool resume(const Ticket ticket, const Completion & completion = Completion()){
+			TicketMap::iterator iter = parked.find(ticket);
+			if (iter == parked.end()){
+				return false;
+			}
+			Task * task = iter->second;
+			if (!task->coroutine.isSuspended()){
+				complete(ticket, completion);
+				return true;
+			}
+			State & thread = task->coroutine.getState();
+			lua_settop(thread.state, 0);
+			const int nargs = (completion) ? completion(thread) : 0;
+			if (nargs < 0){
+				lua_settop(thread.state, 0);
+				return false;
+			}
+			parked.erase(iter);
+			task->ticket = 0;
+			resumeTask(task, nargs);
+			return true;
+		}
+
+		/*
+			Applies queued completions and resumes coroutines which yielded without parking.
+			Returns the number of resumed coroutines.
+		*/
+		size_t poll(){
+			CompletionQueue queued;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				queued.swap(completions);
+			}
+			size_t count = 0;
+			for (CompletionQueue::iterator iter = queued.begin(); iter != queued.end(); iter++){
+				if (resume(iter->first, iter->second)){
+					count++;
+				}
+			}
+			std::vector<Task *> current;
+			current.swap(ready);
+			for (std::vector<Task *>::iterator iter = current.begin(); iter != current.end(); iter++){
+				lua_settop((*iter)->coroutine.getState().state, 0);
+				resumeTask(*iter, 0);
+				count++;
+			}
+			return count;
+		}
+
+		/*
+			Waits for a completion at most timeout (no waiting if a coroutine is ready), then polls
+		*/
+		size_t wait(const std::chrono::milliseconds timeout){
+			if (ready.empty()){
+				std::unique_lock<std::mutex> lock(mutex);
+				condition.wait_for(lock, timeout, [this](){
+					return !completions.empty();
+				});
+			}
+			return poll();
+		}
+
+		/*
+			Runs until all coroutines have finished
+		*/
+		void run(){
+			while (!tasks.empty()){
+				wait(std::chrono::milliseconds(100));
+			}
+		}
+
+		/*
+			Sets a function called by complete() after a completion is queued, e.g. to wake up an event loop.
+			It must be set before completions can be posted from other threads.
+		*/
+		void setNotifier(const std::function<void()> & notifier){
+			this->notifier = notifier;
+		}
+
+		inline State & getState(){
+			return *state;
+		}
+
+		// number of unfinished coroutines
+		inline size_t getTaskCount() const {
+			return tasks.size();
+		}
+
+		// number of coroutines waiting for a completion
+		inline size_t getParkedCount() const {
+			return parked.size();
+		}
+
+		// number of coroutines resumed on the next poll without a completion
+		inline size_t getReadyCount() const {
+			return ready.size();
+		}
+
+		inline bool isParked(const Ticket ticket) const {
+			return parked.find(ticket) != parked.end();
+		}
+
+		// true if L is a coroutine started by this scheduler
+		inline bool isScheduled(lua_State * L) const {
+			return tasks.find(L) != tasks.end();
+		}
+	};
+};
+
+#endif
@@ -0,0 +1,736 @@
+#ifndef LUTOK2_EVENTLOOP_H
+#define LUTOK2_EVENTLOOP_H
+
+#if defined(__linux__)
+
+#include <queue>
+#include <cerrno>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+namespace lutok2 {
+	/*
+		Event loop of scheduled coroutines (Linux epoll and timerfd)
+
+		Lua library functions look blocking, but they park the running coroutine until its file descriptor
+		is ready or its timer expires, so a single thread can drive many scripts written in straight-line style:
+			spawn(f, ...) - starts a coroutine
+			sleep(seconds), now()
+			pipe(), socketpair() - return two descriptors
+			listen(port [, backlog]), port(fd), accept(fd), connect(port) - TCP sockets on the loopback interface
+			read(fd [, maxBytes]), write(fd, data), close(fd)
+		Outside of a scheduled coroutine operations which would block fail, except write which returns number of bytes
+		written if it wrote at least some data.
+		Descriptors are userdata owned by the loop, they are closed by close(fd) or by the garbage collector.
+		Operations are tried right away, the coroutine is parked only when they would block. File descriptors are
+		registered edge-triggered on their first wait and stay registered until close(fd). All timers share one timerfd.
+		Errors are returned as nil and message, read returns nil at the end of stream.
+	*/
+	class EventLoop {
+	private:
+		struct Pending {
+			Scheduler::Ticket ticket;
+			Scheduler::Completion operation;
+
+			Pending() : ticket(0){
+			}
+		};
+
+		struct Watch {
+			Pending reader;
+			Pending writer;
+			// registry reference of a value kept alive while a coroutine waits, e.g. the descriptor of pending connect
+			int anchor;
+
+			Watch() : anchor(LUA_NOREF){
+			}
+		};
+
+		typedef std::unordered_map<int, Watch> WatchMap;
+		typedef std::pair<uint64_t, Scheduler::Ticket> Timer;
+		typedef std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> TimerQueue;
+
+		static const int maxEvents = 256;
+		static const size_t defaultReadSize = 65536;
+		// longer sleeps are cut to one year, deadlines in nanoseconds of monotonic clock can't overflow then
+		static const uint64_t maxSleep = 365ULL * 24 * 3600;
+
+		Scheduler scheduler;
+		int epollFd;
+		int timerFd;
+		int wakeFd;
+		uint64_t armedDeadline;
+		WatchMap watches;
+		TimerQueue timers;
+		Scheduler::Finished finished;
+		Scheduler::Finished errorHandler;
+
+		EventLoop(const EventLoop &);
+		EventLoop & operator= (const EventLoop &);
+
+		static inline void * eventLoopKey(){
+			static char key = 0;
+			return &key;
+		}
+
+		static EventLoop & get(State & state){
+			lua_pushlightuserdata(state.state, eventLoopKey());
+			lua_rawget(state.state, LUA_REGISTRYINDEX);
+			EventLoop * loop = static_cast<EventLoop *>(lua_touserdata(state.state, -1));
+			state.stack->pop(1);
+			if (loop == nullptr){
+				state.error("Event loop of this Lua state was destroyed");
+			}
+			return *loop;
+		}
+
+		static int failure(State & state, const char * message){
+			state.stack->pushNil();
+			state.stack->push<const char *>(message);
+			return 2;
+		}
+
+		static int failure(State & state, const int error){
+			return failure(state, strerror(error));
+		}
+
+		static inline bool wouldBlock(const int error){
+			return error == EAGAIN || error == EWOULDBLOCK;
+		}
+
+		// writes until all data are written or the call would block, returns errno or 0
+		static int writeSome(const int fd, const char * data, const size_t length, size_t & written){
+			bool socket = true;
+			while (written < length){
+				ssize_t count = (socket) ? send(fd, data + written, length - written, MSG_NOSIGNAL) : ::write(fd, data + written, length - written);
+				if (count < 0 && errno == ENOTSOCK && socket){
+					socket = false;
+					continue;
+				}
+				if (count < 0){
+					if (errno == EINTR){
+						continue;
+					}
+					return (wouldBlock(errno)) ? 0 : errno;
+				}
+				written += static_cast<size_t>(count);
+			}
+			return 0;
+		}
+
+		static int readSome(State & state, const int fd, const size_t maxBytes){
+			char local[4096];
+			std::vector<char> large;
+			char * buffer = local;
+			if (maxBytes > sizeof(local)){
+				large.resize(maxBytes);
+				buffer = large.data();
+			}
+			ssize_t count;
+			do {
+				count = ::read(fd, buffer, maxBytes);
+			} while (count < 0 && errno == EINTR);
+			if (count > 0){
+				state.stack->pushLString(buffer, static_cast<size_t>(count));
+				return 1;
+			}else if (count == 0){
+				state.stack->pushNil();
+				return 1;
+			}
+			return (wouldBlock(errno)) ? -1 : failure(state, errno);
+		}
+
+		static void setNoDelay(const int fd){
+			const int value = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+		}
+
+		static sockaddr_in loopbackAddress(const int port){
+			sockaddr_in address;
+			memset(&address, 0, sizeof(address));
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			address.sin_port = htons(static_cast<uint16_t>(port));
+			return address;
+		}
+
+		static inline uint64_t monotonicClock(){
+			timespec time;
+			clock_gettime(CLOCK_MONOTONIC, &time);
+			return static_cast<uint64_t>(time.tv_sec) * 1000000000ULL + static_cast<uint64_t>(time.tv_nsec);
+		}
+
+		/*
+			Tries the operation and waits for the file descriptor if it would block (returns a negative number)
+		*/
+		int perform(State & state, const int fd, const bool write, const Scheduler::Completion & operation){
+			const int result = operation(state);
+			if (result >= 0){
+				return result;
+			}
+			return wait(state, fd, write, operation);
+		}
+
+		/*
+			Parks the running coroutine until the operation on a ready file descriptor completes
+		*/
+		int wait(State & state, const int fd, const bool write, const Scheduler::Completion & operation, const int anchorIndex = 0){
+			if (!scheduler.isScheduled(state.state)){
+				return failure(state, "operation would block outside of a scheduled coroutine");
+			}
+			WatchMap::iterator iter = watches.find(fd);
+			if (iter == watches.end()){
+				epoll_event event;
+				memset(&event, 0, sizeof(event));
+				event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+				event.data.fd = fd;
+				if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0){
+					return failure(state, errno);
+				}
+				iter = watches.insert(std::make_pair(fd, Watch())).first;
+			}
+			Pending & pending = (write) ? iter->second.writer : iter->second.reader;
+			if (pending.ticket != 0){
+				return failure(state, "another coroutine is waiting for this file descriptor");
+			}
+			pending.ticket = scheduler.park(state);
+			pending.operation = operation;
+			if (anchorIndex != 0){
+				unanchor(iter->second);
+				state.stack->pushValue(anchorIndex);
+				iter->second.anchor = luaL_ref(state.state, LUA_REGISTRYINDEX);
+			}
+			return scheduler.yield(state);
+		}
+
+		/*
+			Pushes the value anchored by wait and releases its reference, pushes nil if there's none
+		*/
+		void pushAnchor(State & state, const int fd){
+			WatchMap::iterator iter = watches.find(fd);
+			if (iter == watches.end() || iter->second.anchor == LUA_NOREF){
+				state.stack->pushNil();
+				return;
+			}
+			lua_rawgeti(state.state, LUA_REGISTRYINDEX, iter->second.anchor);
+			unanchor(iter->second);
+		}
+
+		void unanchor(Watch & watch){
+			if (watch.anchor != LUA_NOREF){
+				luaL_unref(scheduler.getState().state, LUA_REGISTRYINDEX, watch.anchor);
+				watch.anchor = LUA_NOREF;
+			}
+		}
+
+		/*
+			Retries the pending operation of a ready file descriptor and resumes its coroutine when it completes
+		*/
+		void retry(const int fd, const bool write){
+			WatchMap::iterator iter = watches.find(fd);
+			if (iter == watches.end()){
+				return;
+			}
+			Pending & slot = (write) ? iter->second.writer : iter->second.reader;
+			if (slot.ticket == 0){
+				return;
+			}
+			Pending pending;
+			std::swap(pending, slot);
+			if (!scheduler.isParked(pending.ticket) || scheduler.resume(pending.ticket, pending.operation)){
+				return;
+			}
+			// still not complete, the operation keeps its progress
+			iter = watches.find(fd);
+			if (iter != watches.end()){
+				std::swap(pending, (write) ? iter->second.writer : iter->second.reader);
+			}
+		}
+
+		void arm(){
+			if (timers.empty()){
+				return;
+			}
+			const uint64_t deadline = timers.top().first;
+			if (armedDeadline != 0 && armedDeadline <= deadline){
+				return;
+			}
+			itimerspec spec;
+			memset(&spec, 0, sizeof(spec));
+			spec.it_value.tv_sec = static_cast<time_t>(deadline / 1000000000ULL);
+			spec.it_value.tv_nsec = static_cast<long>(deadline % 1000000000ULL);
+			if (deadline == 0){
+				spec.it_value.tv_nsec = 1;
+			}
+			timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+			armedDeadline = deadline;
+		}
+
+		void expireTimers(){
+			uint64_t expirations;
+			if (::read(timerFd, &expirations, sizeof(expirations)) < 0){
+				expirations = 0;
+			}
+			armedDeadline = 0;
+			// coroutines resumed here may add new timers, those wait for the next round
+			const uint64_t now = monotonicClock();
+			std::vector<Scheduler::Ticket> expired;
+			while (!timers.empty() && timers.top().first <= now){
+				expired.push_back(timers.top().second);
+				timers.pop();
+			}
+			for (std::vector<Scheduler::Ticket>::iterator iter = expired.begin(); iter != expired.end(); iter++){
+				scheduler.resume(*iter);
+			}
+			arm();
+		}
+
+		/*
+			Lua functions
+		*/
+		static int spawn(State & state){
+			EventLoop & loop = get(state);
+			if (!state.stack->is<LUA_TFUNCTION>(1)){
+				state.error("bad argument #1 (function expected)");
+				return 0;
+			}
+			loop.scheduler.spawn(state, state.stack->getTop() - 1, loop.finished);
+			return 0;
+		}
+
+		static int now(State & state){
+			state.stack->push<LUA_NUMBER>(static_cast<LUA_NUMBER>(monotonicClock()) / 1e9);
+			return 1;
+		}
+
+		static int sleep(State & state){
+			EventLoop & loop = get(state);
+			if (!loop.scheduler.isScheduled(state.state)){
+				return failure(state, "sleep called outside of a scheduled coroutine");
+			}
+			const LUA_NUMBER seconds = state.stack->to<LUA_NUMBER>(1);
+			// NaN fails both comparisons and sleeps for 0 seconds
+			uint64_t delay = 0;
+			if (seconds >= static_cast<LUA_NUMBER>(maxSleep)){
+				delay = maxSleep * 1000000000ULL;
+			}else if (seconds > 0){
+				delay = static_cast<uint64_t>(seconds * 1e9);
+			}
+			loop.timers.push(Timer(monotonicClock() + delay, loop.scheduler.park(state)));
+			loop.arm();
+			return loop.scheduler.yield(state);
+		}
+
+		/*
+			File descriptors are passed to Lua as descriptor userdata, so scripts can use only descriptors
+			created by the loop. Unreachable descriptors are closed by the garbage collector.
+		*/
+		struct Descriptor {
+			int fd;
+		};
+
+		static inline const char * descriptorType(){
+			return "lutok2.EventLoop.descriptor";
+		}
+
+		// pushes a descriptor which doesn't own any file descriptor yet
+		static Descriptor * newDescriptor(State & state){
+			Descriptor * descriptor = static_cast<Descriptor *>(state.stack->newUserData(sizeof(Descriptor)));
+			descriptor->fd = -1;
+			luaL_getmetatable(state.state, descriptorType());
+			state.stack->setMetatable();
+			return descriptor;
+		}
+
+		static Descriptor * checkDescriptor(State & state, const int index){
+			Descriptor * descriptor = static_cast<Descriptor *>(luaL_checkudata(state.state, index, descriptorType()));
+			if (descriptor->fd < 0){
+				state.error("bad argument #%d (descriptor is closed)", index);
+				return nullptr;
+			}
+			return descriptor;
+		}
+
+		static int descriptorGC(lua_State * L){
+			Descriptor * descriptor = static_cast<Descriptor *>(lua_touserdata(L, 1));
+			if (descriptor != nullptr && descriptor->fd >= 0){
+				lua_pushlightuserdata(L, eventLoopKey());
+				lua_rawget(L, LUA_REGISTRYINDEX);
+				EventLoop * loop = static_cast<EventLoop *>(lua_touserdata(L, -1));
+				lua_pop(L, 1);
+				// nobody can wait for an unreachable descriptor, so there's no coroutine to resume
+				if (loop != nullptr){
+					loop->forget(descriptor->fd);
+				}
+				::close(descriptor->fd);
+				descriptor->fd = -1;
+			}
+			return 0;
+		}
+
+		static int descriptorToString(lua_State * L){
+			Descriptor * descriptor = static_cast<Descriptor *>(lua_touserdata(L, 1));
+			lua_pushfstring(L, "descriptor: %d", (descriptor != nullptr) ? descriptor->fd : -1);
+			return 1;
+		}
+
+		static int pipe(State & state){
+			Descriptor * reader = newDescriptor(state);
+			Descriptor * writer = newDescriptor(state);
+			int fds[2];
+			if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0){
+				return failure(state, errno);
+			}
+			reader->fd = fds[0];
+			writer->fd = fds[1];
+			return 2;
+		}
+
+		static int socketpair(State & state){
+			Descriptor * first = newDescriptor(state);
+			Descriptor * second = newDescriptor(state);
+			int fds[2];
+			if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) != 0){
+				return failure(state, errno);
+			}
+			first->fd = fds[0];
+			second->fd = fds[1];
+			return 2;
+		}
+
+		static int listen(State & state){
+			const int port = state.stack->to<int>(1);
+			const int backlog = (state.stack->is<LUA_TNUMBER>(2)) ? state.stack->to<int>(2) : SOMAXCONN;
+			Descriptor * descriptor = newDescriptor(state);
+			const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (fd < 0){
+				return failure(state, errno);
+			}
+			const int reuse = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+			const sockaddr_in address = loopbackAddress(port);
+			if (bind(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 || ::listen(fd, backlog) != 0){
+				const int error = errno;
+				::close(fd);
+				return failure(state, error);
+			}
+			descriptor->fd = fd;
+			return 1;
+		}
+
+		static int port(State & state){
+			const int fd = checkDescriptor(state, 1)->fd;
+			sockaddr_in address;
+			socklen_t length = sizeof(address);
+			if (getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length) != 0){
+				return failure(state, errno);
+			}
+			state.stack->push<int>(ntohs(address.sin_port));
+			return 1;
+		}
+
+		static int accept(State & state){
+			const int fd = checkDescriptor(state, 1)->fd;
+			return get(state).perform(state, fd, false, [fd](State & state) -> int {
+				Descriptor * descriptor = newDescriptor(state);
+				const int client = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (client < 0){
+					const int error = errno;
+					state.stack->pop(1);
+					return (wouldBlock(error) || error == EINTR) ? -1 : failure(state, error);
+				}
+				setNoDelay(client);
+				descriptor->fd = client;
+				return 1;
+			});
+		}
+
+		static int connect(State & state){
+			EventLoop & loop = get(state);
+			if (!loop.scheduler.isScheduled(state.state)){
+				return failure(state, "connect called outside of a scheduled coroutine");
+			}
+			const sockaddr_in address = loopbackAddress(state.stack->to<int>(1));
+			Descriptor * descriptor = newDescriptor(state);
+			const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (fd < 0){
+				return failure(state, errno);
+			}
+			// owned by the descriptor from now on, it's closed by the collector if the coroutine never finishes connecting
+			descriptor->fd = fd;
+			setNoDelay(fd);
+			if (::connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0){
+				return 1;
+			}else if (errno != EINPROGRESS){
+				return failure(state, errno);
+			}
+			// the descriptor is anchored to its watch while the coroutine waits, closing the watch releases it
+			return loop.wait(state, fd, true, [fd](State & state) -> int {
+				get(state).pushAnchor(state, fd);
+				int error = 0;
+				socklen_t length = sizeof(error);
+				if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0){
+					error = errno;
+				}
+				if (error != 0){
+					state.stack->pop(1);
+					return failure(state, error);
+				}
+				return 1;
+			}, -1);
+		}
+
+		static int read(State & state){
+			const int fd = checkDescriptor(state, 1)->fd;
+			const lua_Integer maxBytes = (state.stack->is<LUA_TNUMBER>(2)) ? state.stack->to<lua_Integer>(2) : static_cast<lua_Integer>(defaultReadSize);
+			const size_t length = (maxBytes > 0) ? static_cast<size_t>(maxBytes) : 1;
+			return get(state).perform(state, fd, false, [fd, length](State & state) -> int {
+				return readSome(state, fd, length);
+			});
+		}
+
+		static int write(State & state){
+			const int fd = checkDescriptor(state, 1)->fd;
+			const StringRef data = state.stack->toStringRef(2);
+			size_t written = 0;
+			const int error = writeSome(fd, data.data(), data.length(), written);
+			if (error != 0){
+				return failure(state, error);
+			}
+			EventLoop & loop = get(state);
+			// outside of a coroutine it can't wait, so it works as non-blocking write and returns the written prefix length
+			if (written == data.length() || (written > 0 && !loop.scheduler.isScheduled(state.state))){
+				state.stack->push<lua_Integer>(static_cast<lua_Integer>(written));
+				return 1;
+			}
+			// only the rest that didn't fit is copied
+			const std::string rest(data.data() + written, data.length() - written);
+			const lua_Integer total = static_cast<lua_Integer>(data.length());
+			size_t offset = 0;
+			return loop.wait(state, fd, true, [fd, rest, total, offset](State & state) mutable -> int {
+				const int error = writeSome(fd, rest.data(), rest.length(), offset);
+				if (error != 0){
+					return failure(state, error);
+				}
+				if (offset < rest.length()){
+					return -1;
+				}
+				state.stack->push<lua_Integer>(total);
+				return 1;
+			});
+		}
+
+		static int close(State & state){
+			Descriptor * descriptor = checkDescriptor(state, 1);
+			const int fd = descriptor->fd;
+			descriptor->fd = -1;
+			get(state).release(fd);
+			if (::close(fd) != 0){
+				return failure(state, errno);
+			}
+			state.stack->push<bool>(true);
+			return 1;
+		}
+
+		/*
+			Removes a file descriptor which is going to be closed from epoll
+		*/
+		void forget(const int fd){
+			WatchMap::iterator iter = watches.find(fd);
+			if (iter != watches.end()){
+				epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+				unanchor(iter->second);
+				watches.erase(iter);
+			}
+		}
+
+		/*
+			Same as forget, coroutines waiting for the file descriptor get nil and error message
+		*/
+		void release(const int fd){
+			WatchMap::iterator iter = watches.find(fd);
+			if (iter == watches.end()){
+				return;
+			}
+			const Scheduler::Ticket tickets[] = {iter->second.reader.ticket, iter->second.writer.ticket};
+			forget(fd);
+			for (size_t i = 0; i < 2; i++){
+				if (tickets[i] != 0){
+					scheduler.resume(tickets[i], [](State & state) -> int {
+						return failure(state, "file descriptor closed");
+					});
+				}
+			}
+		}
+	public:
+		explicit EventLoop(State & state) : scheduler(state), armedDeadline(0){
+			epollFd = epoll_create1(EPOLL_CLOEXEC);
+			timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (epollFd < 0 || timerFd < 0 || wakeFd < 0){
+				const int error = errno;
+				closeDescriptors();
+				throw std::runtime_error(std::string("Can't create event loop: ") + strerror(error));
+			}
+			const int fds[] = {timerFd, wakeFd};
+			for (size_t i = 0; i < 2; i++){
+				epoll_event event;
+				memset(&event, 0, sizeof(event));
+				event.events = EPOLLIN;
+				event.data.fd = fds[i];
+				epoll_ctl(epollFd, EPOLL_CTL_ADD, fds[i], &event);
+			}
+
+			lua_pushlightuserdata(state.state, eventLoopKey());
+			lua_pushlightuserdata(state.state, this);
+			lua_rawset(state.state, LUA_REGISTRYINDEX);
+
+			if (luaL_newmetatable(state.state, descriptorType()) != 0){
+				lua_pushcfunction(state.state, descriptorGC);
+				lua_setfield(state.state, -2, "__gc");
+				lua_pushcfunction(state.state, descriptorToString);
+				lua_setfield(state.state, -2, "__tostring");
+			}
+			state.stack->pop(1);
+
+			// completions posted from other threads wake up epoll_wait
+			const int fd = wakeFd;
+			scheduler.setNotifier([fd](){
+				const uint64_t value = 1;
+				if (::write(fd, &value, sizeof(value)) < 0){
+					return;
+				}
+			});
+			errorHandler = [](Coroutine & coroutine, int status){
+				LUTOK2_NOT_USED(status);
+				const std::string message = coroutine.getState().stack->to<const std::string>(-1);
+				fprintf(stderr, "Coroutine error: %s\n%s\n", message.c_str(), coroutine.traceback().str().c_str());
+			};
+			finished = [this](Coroutine & coroutine, int status){
+				if (status != 0 && errorHandler){
+					errorHandler(coroutine, status);
+				}
+			};
+		}
+
+		~EventLoop(){
+			lua_State * L = scheduler.getState().state;
+			lua_pushlightuserdata(L, eventLoopKey());
+			lua_pushnil(L);
+			lua_rawset(L, LUA_REGISTRYINDEX);
+			scheduler.setNotifier(std::function<void()>());
+			for (WatchMap::iterator iter = watches.begin(); iter != watches.end(); iter++){
+				unanchor(iter->second);
+			}
+			closeDescriptors();
+		}
+
+		/*
+			Registers the library and leaves its table on the stack
+		*/
+		void open(const std::string & name = "eventloop"){
+			Module members;
+			members["spawn"] = spawn;
+			members["now"] = now;
+			members["sleep"] = sleep;
+			members["pipe"] = pipe;
+			members["socketpair"] = socketpair;
+			members["listen"] = listen;
+			members["port"] = port;
+			members["accept"] = accept;
+			members["connect"] = connect;
+			members["read"] = read;
+			members["write"] = write;
+			members["close"] = close;
+			scheduler.getState().registerLib(members, name);
+		}
+
+		/*
+			Waits at most timeout milliseconds (-1 waits until an event arrives) and resumes coroutines
+			of ready file descriptors, expired timers and posted completions. Returns the number of events.
+		*/
+		size_t runOnce(const int timeout = -1){
+			scheduler.poll();
+			if (scheduler.getTaskCount() == 0){
+				return 0;
+			}
+			epoll_event events[maxEvents];
+			int count;
+			do {
+				count = epoll_wait(epollFd, events, maxEvents, (scheduler.getReadyCount() > 0) ? 0 : timeout);
+			} while (count < 0 && errno == EINTR);
+			for (int i = 0; i < count; i++){
+				const int fd = events[i].data.fd;
+				const uint32_t flags = events[i].events;
+				if (fd == timerFd){
+					expireTimers();
+				}else if (fd == wakeFd){
+					uint64_t value;
+					if (::read(wakeFd, &value, sizeof(value)) < 0){
+						value = 0;
+					}
+				}else{
+					if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
+						retry(fd, false);
+					}
+					if (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)){
+						retry(fd, true);
+					}
+				}
+			}
+			scheduler.poll();
+			return (count > 0) ? static_cast<size_t>(count) : 0;
+		}
+
+		/*
+			Runs until all coroutines have finished
+		*/
+		void run(){
+			while (scheduler.getTaskCount() > 0){
+				runOnce(-1);
+			}
+		}
+
+		inline Scheduler & getScheduler(){
+			return scheduler;
+		}
+
+		/*
+			Sets a function called when a coroutine started by spawn() from Lua fails,
+			by default the error and its traceback are printed to stderr
+		*/
+		void setErrorHandler(const Scheduler::Finished & handler){
+			errorHandler = handler;
+		}
+
+		// number of file descriptors registered in epoll
+		inline size_t getWatchCount() const {
+			return watches.size();
+		}
+
+		inline size_t getTimerCount() const {
+			return timers.size();
+		}
+	private:
+		void closeDescriptors(){
+			const int fds[] = {wakeFd, timerFd, epollFd};
+			for (size_t i = 0; i < 3; i++){
+				if (fds[i] >= 0){
+					::close(fds[i]);
+				}
+			}
+		}
+	};
+};
+
+#endif
+
+#endif
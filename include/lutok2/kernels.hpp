@@ -0,0 +1,490 @@
+#ifndef LUTOK2_KERNELS_H
+#define LUTOK2_KERNELS_H
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#	define LUTOK2_SIMD_X86 1
+#	include <immintrin.h>
+#	if defined(_MSC_VER)
+#		include <intrin.h>
+#	endif
+#else
+#	define LUTOK2_SIMD_X86 0
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#	define LUTOK2_TARGET_SSE __attribute__((target("sse2")))
+#	define LUTOK2_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#	define LUTOK2_TARGET_SSE
+#	define LUTOK2_TARGET_AVX2
+#endif
+
+#include <limits>
+
+namespace lutok2 {
+	/*
+		Bulk numeric kernels over f32/f64 buffers
+
+		Every kernel exists in scalar, SSE2 and AVX2+FMA variant, the best one supported by CPU
+		is selected at run time. Prefix sum and histogram are sequential by nature and use scalar code only.
+	*/
+	enum SimdLevel {
+		SimdScalar = 0,
+		SimdSSE = 1,
+		SimdAVX2 = 2
+	};
+
+	class Simd {
+	private:
+		static SimdLevel detect(){
+#if LUTOK2_SIMD_X86 && (defined(__GNUC__) || defined(__clang__))
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+				return SimdAVX2;
+			}
+			if (__builtin_cpu_supports("sse2")){
+				return SimdSSE;
+			}
+#elif LUTOK2_SIMD_X86 && defined(_MSC_VER)
+			int info[4];
+			__cpuid(info, 0);
+			const int maxLeaf = info[0];
+			__cpuid(info, 1);
+			const bool sse2 = (info[3] & (1 << 26)) != 0;
+			const bool fma = (info[2] & (1 << 12)) != 0;
+			const bool osxsave = (info[2] & (1 << 27)) != 0;
+			if (maxLeaf >= 7 && fma && osxsave && (_xgetbv(0) & 6) == 6){
+				__cpuidex(info, 7, 0);
+				if ((info[1] & (1 << 5)) != 0){
+					return SimdAVX2;
+				}
+			}
+			if (sse2){
+				return SimdSSE;
+			}
+#endif
+			return SimdScalar;
+		}
+
+		static std::atomic<int> & currentLevel(){
+			static std::atomic<int> level(static_cast<int>(detect()));
+			return level;
+		}
+	public:
+		static SimdLevel getSupportedLevel(){
+			static const SimdLevel level = detect();
+			return level;
+		}
+
+		static inline SimdLevel getLevel(){
+			return static_cast<SimdLevel>(currentLevel().load(std::memory_order_relaxed));
+		}
+
+		/*
+			Restricts kernels to a lower instruction set (e.g. for comparison), levels above the supported one are ignored.
+		*/
+		static void setLevel(const SimdLevel level){
+			currentLevel().store(static_cast<int>((level < getSupportedLevel()) ? level : getSupportedLevel()));
+		}
+
+		static const char * getLevelName(const SimdLevel level){
+			switch (level){
+			case SimdAVX2:
+				return "avx2";
+			case SimdSSE:
+				return "sse2";
+			default:
+				return "scalar";
+			}
+		}
+	};
+
+	/*
+		Vector traits - one register of values and operations on it
+	*/
+	template<typename T> struct ScalarVector {
+		typedef T type;
+		static const size_t width = 1;
+		static inline type load(const T * p){ return *p; }
+		static inline void store(T * p, const type v){ *p = v; }
+		static inline type set(const T value){ return value; }
+		static inline type add(const type a, const type b){ return a + b; }
+		static inline type mul(const type a, const type b){ return a * b; }
+		static inline type fma(const type a, const type b, const type c){ return a * b + c; }
+		static inline type min(const type a, const type b){ return (b < a) ? b : a; }
+		static inline type max(const type a, const type b){ return (a < b) ? b : a; }
+	};
+
+#if LUTOK2_SIMD_X86
+	template<typename T> struct SSEVector;
+
+	template<> struct SSEVector<float> {
+		typedef __m128 type;
+		static const size_t width = 4;
+		LUTOK2_TARGET_SSE static inline type load(const float * p){ return _mm_loadu_ps(p); }
+		LUTOK2_TARGET_SSE static inline void store(float * p, const type v){ _mm_storeu_ps(p, v); }
+		LUTOK2_TARGET_SSE static inline type set(const float value){ return _mm_set1_ps(value); }
+		LUTOK2_TARGET_SSE static inline type add(const type a, const type b){ return _mm_add_ps(a, b); }
+		LUTOK2_TARGET_SSE static inline type mul(const type a, const type b){ return _mm_mul_ps(a, b); }
+		LUTOK2_TARGET_SSE static inline type fma(const type a, const type b, const type c){ return _mm_add_ps(_mm_mul_ps(a, b), c); }
+		LUTOK2_TARGET_SSE static inline type min(const type a, const type b){ return _mm_min_ps(a, b); }
+		LUTOK2_TARGET_SSE static inline type max(const type a, const type b){ return _mm_max_ps(a, b); }
+	};
+
+	template<> struct SSEVector<double> {
+		typedef __m128d type;
+		static const size_t width = 2;
+		LUTOK2_TARGET_SSE static inline type load(const double * p){ return _mm_loadu_pd(p); }
+		LUTOK2_TARGET_SSE static inline void store(double * p, const type v){ _mm_storeu_pd(p, v); }
+		LUTOK2_TARGET_SSE static inline type set(const double value){ return _mm_set1_pd(value); }
+		LUTOK2_TARGET_SSE static inline type add(const type a, const type b){ return _mm_add_pd(a, b); }
+		LUTOK2_TARGET_SSE static inline type mul(const type a, const type b){ return _mm_mul_pd(a, b); }
+		LUTOK2_TARGET_SSE static inline type fma(const type a, const type b, const type c){ return _mm_add_pd(_mm_mul_pd(a, b), c); }
+		LUTOK2_TARGET_SSE static inline type min(const type a, const type b){ return _mm_min_pd(a, b); }
+		LUTOK2_TARGET_SSE static inline type max(const type a, const type b){ return _mm_max_pd(a, b); }
+	};
+
+	template<typename T> struct AVX2Vector;
+
+	template<> struct AVX2Vector<float> {
+		typedef __m256 type;
+		static const size_t width = 8;
+		LUTOK2_TARGET_AVX2 static inline type load(const float * p){ return _mm256_loadu_ps(p); }
+		LUTOK2_TARGET_AVX2 static inline void store(float * p, const type v){ _mm256_storeu_ps(p, v); }
+		LUTOK2_TARGET_AVX2 static inline type set(const float value){ return _mm256_set1_ps(value); }
+		LUTOK2_TARGET_AVX2 static inline type add(const type a, const type b){ return _mm256_add_ps(a, b); }
+		LUTOK2_TARGET_AVX2 static inline type mul(const type a, const type b){ return _mm256_mul_ps(a, b); }
+		LUTOK2_TARGET_AVX2 static inline type fma(const type a, const type b, const type c){ return _mm256_fmadd_ps(a, b, c); }
+		LUTOK2_TARGET_AVX2 static inline type min(const type a, const type b){ return _mm256_min_ps(a, b); }
+		LUTOK2_TARGET_AVX2 static inline type max(const type a, const type b){ return _mm256_max_ps(a, b); }
+	};
+
+	template<> struct AVX2Vector<double> {
+		typedef __m256d type;
+		static const size_t width = 4;
+		LUTOK2_TARGET_AVX2 static inline type load(const double * p){ return _mm256_loadu_pd(p); }
+		LUTOK2_TARGET_AVX2 static inline void store(double * p, const type v){ _mm256_storeu_pd(p, v); }
+		LUTOK2_TARGET_AVX2 static inline type set(const double value){ return _mm256_set1_pd(value); }
+		LUTOK2_TARGET_AVX2 static inline type add(const type a, const type b){ return _mm256_add_pd(a, b); }
+		LUTOK2_TARGET_AVX2 static inline type mul(const type a, const type b){ return _mm256_mul_pd(a, b); }
+		LUTOK2_TARGET_AVX2 static inline type fma(const type a, const type b, const type c){ return _mm256_fmadd_pd(a, b, c); }
+		LUTOK2_TARGET_AVX2 static inline type min(const type a, const type b){ return _mm256_min_pd(a, b); }
+		LUTOK2_TARGET_AVX2 static inline type max(const type a, const type b){ return _mm256_max_pd(a, b); }
+	};
+#endif
+
+	/*
+		Kernel bodies shared by all instruction sets. Kernels of one set are compiled with its TARGET attribute
+		so vector traits can be inlined into them. Expects V (vector traits) and T (item type) typedefs.
+	*/
+#define LUTOK2_VECTOR_KERNELS(TARGET) \
+	TARGET static void add(T * dst, const T * a, const T * b, const size_t n){ \
+		size_t i = 0; \
+		for (; i + V::width <= n; i += V::width){ \
+			V::store(dst + i, V::add(V::load(a + i), V::load(b + i))); \
+		} \
+		for (; i < n; i++){ \
+			dst[i] = a[i] + b[i]; \
+		} \
+	} \
+	TARGET static void mul(T * dst, const T * a, const T * b, const size_t n){ \
+		size_t i = 0; \
+		for (; i + V::width <= n; i += V::width){ \
+			V::store(dst + i, V::mul(V::load(a + i), V::load(b + i))); \
+		} \
+		for (; i < n; i++){ \
+			dst[i] = a[i] * b[i]; \
+		} \
+	} \
+	TARGET static void fma(T * dst, const T * a, const T * b, const T * c, const size_t n){ \
+		size_t i = 0; \
+		for (; i + V::width <= n; i += V::width){ \
+			V::store(dst + i, V::fma(V::load(a + i), V::load(b + i), V::load(c + i))); \
+		} \
+		for (; i < n; i++){ \
+			dst[i] = a[i] * b[i] + c[i]; \
+		} \
+	} \
+	TARGET static void clamp(T * dst, const T * src, const T low, const T high, const size_t n){ \
+		const typename V::type vlow = V::set(low); \
+		const typename V::type vhigh = V::set(high); \
+		size_t i = 0; \
+		for (; i + V::width <= n; i += V::width){ \
+			V::store(dst + i, V::min(V::max(V::load(src + i), vlow), vhigh)); \
+		} \
+		for (; i < n; i++){ \
+			const T value = (src[i] < low) ? low : src[i]; \
+			dst[i] = (high < value) ? high : value; \
+		} \
+	} \
+	TARGET static T min(const T * src, const size_t n){ \
+		T result = (n > 0) ? src[0] : std::numeric_limits<T>::quiet_NaN(); \
+		size_t i = 0; \
+		if (n >= V::width){ \
+			typename V::type accumulator = V::load(src); \
+			for (i = V::width; i + V::width <= n; i += V::width){ \
+				accumulator = V::min(accumulator, V::load(src + i)); \
+			} \
+			T lanes[V::width]; \
+			V::store(lanes, accumulator); \
+			for (size_t j = 0; j < V::width; j++){ \
+				result = (lanes[j] < result) ? lanes[j] : result; \
+			} \
+		} \
+		for (; i < n; i++){ \
+			result = (src[i] < result) ? src[i] : result; \
+		} \
+		return result; \
+	} \
+	TARGET static T max(const T * src, const size_t n){ \
+		T result = (n > 0) ? src[0] : std::numeric_limits<T>::quiet_NaN(); \
+		size_t i = 0; \
+		if (n >= V::width){ \
+			typename V::type accumulator = V::load(src); \
+			for (i = V::width; i + V::width <= n; i += V::width){ \
+				accumulator = V::max(accumulator, V::load(src + i)); \
+			} \
+			T lanes[V::width]; \
+			V::store(lanes, accumulator); \
+			for (size_t j = 0; j < V::width; j++){ \
+				result = (result < lanes[j]) ? lanes[j] : result; \
+			} \
+		} \
+		for (; i < n; i++){ \
+			result = (result < src[i]) ? src[i] : result; \
+		} \
+		return result; \
+	}
+
+	template<typename T> struct ScalarKernels {
+		typedef ScalarVector<T> V;
+		LUTOK2_VECTOR_KERNELS()
+	};
+
+#if LUTOK2_SIMD_X86
+	template<typename T> struct SSEKernels {
+		typedef SSEVector<T> V;
+		LUTOK2_VECTOR_KERNELS(LUTOK2_TARGET_SSE)
+	};
+
+	template<typename T> struct AVX2Kernels {
+		typedef AVX2Vector<T> V;
+		LUTOK2_VECTOR_KERNELS(LUTOK2_TARGET_AVX2)
+	};
+
+#define LUTOK2_SIMD_DISPATCH(FN, ...) \
+	switch (Simd::getLevel()){ \
+	case SimdAVX2: \
+		return AVX2Kernels<T>::FN(__VA_ARGS__); \
+	case SimdSSE: \
+		return SSEKernels<T>::FN(__VA_ARGS__); \
+	default: \
+		return ScalarKernels<T>::FN(__VA_ARGS__); \
+	}
+#else
+#define LUTOK2_SIMD_DISPATCH(FN, ...) \
+	return ScalarKernels<T>::FN(__VA_ARGS__);
+#endif
+
+	/*
+		Kernels with run time dispatch, T is float or double
+	*/
+	template<typename T> struct Kernels {
+		static void add(T * dst, const T * a, const T * b, const size_t n){
+			LUTOK2_SIMD_DISPATCH(add, dst, a, b, n)
+		}
+		static void mul(T * dst, const T * a, const T * b, const size_t n){
+			LUTOK2_SIMD_DISPATCH(mul, dst, a, b, n)
+		}
+		// dst = a * b + c
+		static void fma(T * dst, const T * a, const T * b, const T * c, const size_t n){
+			LUTOK2_SIMD_DISPATCH(fma, dst, a, b, c, n)
+		}
+		static void clamp(T * dst, const T * src, const T low, const T high, const size_t n){
+			LUTOK2_SIMD_DISPATCH(clamp, dst, src, low, high, n)
+		}
+		// NaN for empty input
+		static T min(const T * src, const size_t n){
+			LUTOK2_SIMD_DISPATCH(min, src, n)
+		}
+		static T max(const T * src, const size_t n){
+			LUTOK2_SIMD_DISPATCH(max, src, n)
+		}
+
+		// inclusive prefix sum, dst may be the same as src
+		static void prefixSum(T * dst, const T * src, const size_t n){
+			T sum = 0;
+			for (size_t i = 0; i < n; i++){
+				sum += src[i];
+				dst[i] = sum;
+			}
+		}
+
+		/*
+			Counts values in bins equal-width bins over [low, high], values outside of the range are skipped.
+		*/
+		static void histogram(const T * src, const size_t n, const T low, const T high, size_t * counts, const size_t bins){
+			const double scale = (high > low) ? bins / (static_cast<double>(high) - low) : 0.0;
+			for (size_t i = 0; i < n; i++){
+				const T value = src[i];
+				if (value >= low && value <= high){
+					size_t bin = static_cast<size_t>((value - low) * scale);
+					counts[(bin < bins) ? bin : (bins - 1)]++;
+				}
+			}
+		}
+	};
+
+	/*
+		Lua library of buffer kernels
+
+		Functions accept f32 and f64 buffers (LuaBufferF32 and LuaBufferF64 interfaces must be registered),
+		all buffers of one call must have the same type and length.
+			add(dst, a, b), mul(dst, a, b), fma(dst, a, b, c), clamp(dst, src, low, high), prefixSum(dst, src)
+			min(src), max(src) - nil for empty buffer
+			histogram(src, low, high, bins) - returns table of counts, bins must not exceed maxHistogramBins
+			level() - returns instruction set in use ("avx2", "sse2" or "scalar")
+	*/
+	class KernelLib {
+	public:
+		// upper bound of bins, the count table is allocated for every call
+		static const int maxHistogramBins = 65536;
+	private:
+		template<typename T> static Buffer<T> * toBuffer(State & state, const int index){
+			LuaBuffer<T> * iface = state.getInterface<LuaBuffer<T>>();
+			if (iface == nullptr){
+				return nullptr;
+			}
+			iface->luaState = state.state;
+			return iface->get(index);
+		}
+
+		template<typename T> static Buffer<T> * checkBuffer(State & state, const int index, const Buffer<T> * first){
+			Buffer<T> * buffer = toBuffer<T>(state, index);
+			if (buffer == nullptr){
+				state.error("bad argument #%d (buffer of the same type expected)", index);
+			}else if (buffer->length != first->length){
+				state.error("bad argument #%d (buffer length %d differs from %d)", index, static_cast<int>(buffer->length), static_cast<int>(first->length));
+			}
+			return buffer;
+		}
+
+		/*
+			Calls Op::call<float> or Op::call<double> depending on type of the first buffer argument
+		*/
+		template<typename Op> static int dispatch(State & state){
+			Buffer<float> * bufferF32 = toBuffer<float>(state, 1);
+			if (bufferF32 != nullptr){
+				return Op::call(state, bufferF32);
+			}
+			Buffer<double> * bufferF64 = toBuffer<double>(state, 1);
+			if (bufferF64 != nullptr){
+				return Op::call(state, bufferF64);
+			}
+			state.error("bad argument #1 (f32 or f64 buffer expected)");
+			return 0;
+		}
+
+		struct Add {
+			template<typename T> static int call(State & state, Buffer<T> * dst){
+				Buffer<T> * a = checkBuffer<T>(state, 2, dst);
+				Buffer<T> * b = checkBuffer<T>(state, 3, dst);
+				Kernels<T>::add(dst->data, a->data, b->data, dst->length);
+				return 0;
+			}
+		};
+
+		struct Mul {
+			template<typename T> static int call(State & state, Buffer<T> * dst){
+				Buffer<T> * a = checkBuffer<T>(state, 2, dst);
+				Buffer<T> * b = checkBuffer<T>(state, 3, dst);
+				Kernels<T>::mul(dst->data, a->data, b->data, dst->length);
+				return 0;
+			}
+		};
+
+		struct Fma {
+			template<typename T> static int call(State & state, Buffer<T> * dst){
+				Buffer<T> * a = checkBuffer<T>(state, 2, dst);
+				Buffer<T> * b = checkBuffer<T>(state, 3, dst);
+				Buffer<T> * c = checkBuffer<T>(state, 4, dst);
+				Kernels<T>::fma(dst->data, a->data, b->data, c->data, dst->length);
+				return 0;
+			}
+		};
+
+		struct Clamp {
+			template<typename T> static int call(State & state, Buffer<T> * dst){
+				Buffer<T> * src = checkBuffer<T>(state, 2, dst);
+				Kernels<T>::clamp(dst->data, src->data, state.stack->to<T>(3), state.stack->to<T>(4), dst->length);
+				return 0;
+			}
+		};
+
+		struct PrefixSum {
+			template<typename T> static int call(State & state, Buffer<T> * dst){
+				Buffer<T> * src = checkBuffer<T>(state, 2, dst);
+				Kernels<T>::prefixSum(dst->data, src->data, dst->length);
+				return 0;
+			}
+		};
+
+		struct Min {
+			template<typename T> static int call(State & state, Buffer<T> * src){
+				if (src->length == 0){
+					return 0;
+				}
+				state.stack->push<LUA_NUMBER>(static_cast<LUA_NUMBER>(Kernels<T>::min(src->data, src->length)));
+				return 1;
+			}
+		};
+
+		struct Max {
+			template<typename T> static int call(State & state, Buffer<T> * src){
+				if (src->length == 0){
+					return 0;
+				}
+				state.stack->push<LUA_NUMBER>(static_cast<LUA_NUMBER>(Kernels<T>::max(src->data, src->length)));
+				return 1;
+			}
+		};
+
+		struct Histogram {
+			template<typename T> static int call(State & state, Buffer<T> * src){
+				const int bins = state.stack->to<int>(4);
+				if (bins <= 0 || bins > maxHistogramBins){
+					state.error("bad argument #4 (number of bins between 1 and %d expected)", maxHistogramBins);
+					return 0;
+				}
+				std::vector<size_t> counts(bins, 0);
+				Kernels<T>::histogram(src->data, src->length, state.stack->to<T>(2), state.stack->to<T>(3), counts.data(), counts.size());
+				state.stack->push<const std::vector<size_t> &>(counts);
+				return 1;
+			}
+		};
+
+		static int level(State & state){
+			state.stack->push<const char *>(Simd::getLevelName(Simd::getLevel()));
+			return 1;
+		}
+	public:
+		/*
+			Registers the library and leaves its table on the stack
+		*/
+		static void open(State & state, const std::string & name = "kernels"){
+			Module members;
+			members["add"] = dispatch<Add>;
+			members["mul"] = dispatch<Mul>;
+			members["fma"] = dispatch<Fma>;
+			members["clamp"] = dispatch<Clamp>;
+			members["prefixSum"] = dispatch<PrefixSum>;
+			members["min"] = dispatch<Min>;
+			members["max"] = dispatch<Max>;
+			members["histogram"] = dispatch<Histogram>;
+			members["level"] = level;
+			state.registerLib(members, name);
+		}
+	};
+};
+
+#endif
@@ -17,11 +17,15 @@ namespace lutok2 {
 	typedef std::unordered_map<std::string, cxx_function> Module;
 	typedef std::vector<int> StackContent;
 	static int cxx_function_wrapper(lua_State *);
-	static void storeCurrentState(State *, bool);
-	static int free_current_state(lua_State *);
+	static int cxx_function_gc(lua_State *);
+	template<typename F> struct FunctionBinding;
+	static int free_state_data(lua_State *);
 
 	class BaseObject {
 	public:
+		virtual ~BaseObject(){
+
+		}
 		virtual void getConstructor(){
 
 		}
@@ -30,65 +34,72 @@ namespace lutok2 {
 };
 
 #include "exceptions.hpp"
+#include "allocator.hpp"
+#include "mappedfile.hpp"
+#include "value.hpp"
+#include "traceback.hpp"
+#include "profiler.hpp"
 #include "stack.hpp"
 #include "state.hpp"
 #include "stackdebugger.hpp"
+#include "binding.hpp"
 #include "object.hpp"
+#include "buffer.hpp"
+#include "kernels.hpp"
+#include "chunkcache.hpp"
+#include "statepool.hpp"
+#include "sampler.hpp"
+#include "coroutine.hpp"
+#include "eventloop.hpp"
 
 namespace lutok2 {
 
+	/*
+		Dispatches a Lua call to the C++ function stored in upvalue 1.
+		The hot path does not query debug info and does not allocate - State is only a view over L.
+	*/
 	static int cxx_function_wrapper(lua_State * L) {
-		State state = State(L, false);
-		Stack * stack = state.stack;
-		const lua_Debug info = state.getInfo("nSlu");
-		//StackContent stackContent = stack->getStackContent();
+		Function * originalFunction = static_cast<Function *>(lua_touserdata(L, lua_upvalueindex(1)));
+		State state(L, false);
 
-		int upvalues = info.nups;
-		if (upvalues >= 1){
-			int upvalueIndex = stack->upvalueIndex(1);
-			stack->pushValue(upvalueIndex);
-			int t = stack->type(-1);
-			if (t == LUA_TUSERDATA){
-				Function ** originalFunction = reinterpret_cast<Function **>(stack->to<void*>(-1));
-				stack->pop(1);
-				if (originalFunction != nullptr){
-					try{
-						return (**originalFunction)(state);
-					}
-					catch (const std::exception & e){
-						state.error("Unhandled exception: %s", e.what());
-						return 1;
-					}
-				}
-				else{
-					const std::string traceBack = state.traceback();
-					state.error("Invalid function pointer!: %s", traceBack.c_str());
-					return 1;
-				}
+		if (originalFunction != nullptr){
+			try{
+#if defined(LUTOK2_PROFILING)
+				LUTOK2_PROFILE_SCOPE(Profiler::functionEntry(L, originalFunction));
+#endif
+				return (*originalFunction)(state);
 			}
-			else{
-				const std::string traceBack = state.traceback();
-				state.error("Stack corrupted!: %s", traceBack.c_str());
-				return 1;
+			catch (const std::exception & e){
+				// raise the error outside of catch block so the exception object is released before longjmp
+				luaL_where(L, 1);
+				lua_pushfstring(L, "Unhandled exception: %s", e.what());
+				lua_concat(L, 2);
 			}
+			return lua_error(L);
 		}
 		else{
-			const std::string traceBack = state.traceback();
-			state.error("Closure upvalues corrupted!: %s", traceBack.c_str());
-			return 1;
+			// traceback is left to the caller's message handler
+			return luaL_error(L, "Closure upvalues corrupted!");
 		}
 	}
 
-	static int free_current_state(lua_State * L){
-		/*
-		State * state = State::getCurrentState();
-		//free all stored object interfaces
-		for (std::unordered_map<std::string, BaseObject*>::iterator iter = state->interfaces.begin(); iter != state->interfaces.end(); iter++){
-			delete (iter->second);
+	static int cxx_function_gc(lua_State * L) {
+		Function * wrappedFunction = static_cast<Function *>(lua_touserdata(L, 1));
+		if (wrappedFunction != nullptr){
+			wrappedFunction->~Function();
 		}
+		return 0;
+	}
 
-		delete state;
-		*/
+	/*
+		Releases interfaces registered in Lua state, called on lua_close.
+		Object instances are created after StateData so they are finalized first.
+	*/
+	static int free_state_data(lua_State * L){
+		StateData * stateData = static_cast<StateData *>(lua_touserdata(L, 1));
+		if (stateData != nullptr){
+			stateData->~StateData();
+		}
 		return 0;
 	}
 };
@@ -0,0 +1,100 @@
+#ifndef LUTOK2_MAPPEDFILE_H
+#define LUTOK2_MAPPEDFILE_H
+
+#if defined(_WIN32)
+#	ifndef WIN32_LEAN_AND_MEAN
+#		define WIN32_LEAN_AND_MEAN
+#	endif
+#	ifndef NOMINMAX
+#		define NOMINMAX
+#	endif
+#	include <windows.h>
+#else
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <fcntl.h>
+#	include <unistd.h>
+#endif
+
+namespace lutok2 {
+	/*
+		Read-only memory mapped file, used to feed scripts into Lua without intermediate copies.
+		getData() returns nullptr if the file can't be mapped (including empty files).
+	*/
+	class MappedFile {
+	private:
+		const char * data;
+		size_t length;
+#if defined(_WIN32)
+		HANDLE file;
+		HANDLE mapping;
+#endif
+		MappedFile(const MappedFile &);
+		MappedFile & operator= (const MappedFile &);
+	public:
+		explicit MappedFile(const std::string & fileName){
+			data = nullptr;
+			length = 0;
+#if defined(_WIN32)
+			mapping = NULL;
+			file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (file == INVALID_HANDLE_VALUE){
+				return;
+			}
+			LARGE_INTEGER fileSize;
+			if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0){
+				mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+				if (mapping != NULL){
+					data = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+					if (data != nullptr){
+						length = static_cast<size_t>(fileSize.QuadPart);
+					}
+				}
+			}
+#else
+			int fd = open(fileName.c_str(), O_RDONLY);
+			if (fd < 0){
+				return;
+			}
+			struct stat fileStat;
+			if (fstat(fd, &fileStat) == 0 && S_ISREG(fileStat.st_mode) && fileStat.st_size > 0){
+				void * mapped = mmap(nullptr, static_cast<size_t>(fileStat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+				if (mapped != MAP_FAILED){
+					data = static_cast<const char *>(mapped);
+					length = static_cast<size_t>(fileStat.st_size);
+				}
+			}
+			// mapping stays valid after the descriptor is closed
+			close(fd);
+#endif
+		}
+
+		~MappedFile(){
+#if defined(_WIN32)
+			if (data != nullptr){
+				UnmapViewOfFile(data);
+			}
+			if (mapping != NULL){
+				CloseHandle(mapping);
+			}
+			if (file != INVALID_HANDLE_VALUE){
+				CloseHandle(file);
+			}
+#else
+			if (data != nullptr){
+				munmap(const_cast<char *>(data), length);
+			}
+#endif
+		}
+
+		inline const char * getData() const {
+			return data;
+		}
+
+		inline size_t getLength() const {
+			return length;
+		}
+	};
+};
+
+#endif
@@ -18,15 +18,34 @@ namespace lutok2 {
 		typedef struct {
 			C * instance;
 			bool owned;
+			// instance is constructed inside of the userdata block, right after the wrapper
+			bool inlined;
 		} ObjWrapper;
+
+		/*
+			Offset of inlined instance in the userdata block. Lua aligns userdata memory for double, void * and long.
+		*/
+		static inline size_t inlineOffset(){
+			return (sizeof(ObjWrapper) + alignof(C) - 1) / alignof(C) * alignof(C);
+		}
 	public:
 		lua_State * luaState;
 	protected:
+		/*
+			Metatable of this class identifies its instances - type check is a single pointer comparison.
+		*/
+		const void * metatable;
+		// registry reference of the metatable, objects are pushed without any metatable name lookups
+		int metatableRef;
+
 		inline ObjWrapper * getWrapped(const int index){
 			State state = State(luaState, false);
 			Stack * stack = state.stack;
-			ObjWrapper * wrapper = static_cast<ObjWrapper *>(stack->getUserData(index, typeid(C).name()));
-			return wrapper;
+			if (metatable != nullptr){
+				return static_cast<ObjWrapper *>(stack->getUserDataByMetatable(index, metatable));
+			}else{
+				return static_cast<ObjWrapper *>(stack->getUserData(index, typeid(C).name()));
+			}
 		}
 
 		inline ObjWrapper * getWrapped(const int index, const std::string & typeName){
@@ -36,48 +55,74 @@ namespace lutok2 {
 			return wrapper;
 		}
 
+		/*
+			Accepts objects of any listed type (e.g. derived classes).
+			Object metatable is fetched once and its typename is compared with each of names.
+		*/
 		ObjWrapper * getWrapped(const int index, const std::forward_list<std::string> & typeNames){
 			State state = State(luaState, false);
 			Stack * stack = state.stack;
 			ObjWrapper * wrapper = nullptr;
 
-			for (std::forward_list<std::string>::const_iterator iter = typeNames.begin(); iter != typeNames.end(); iter++){
-				wrapper = static_cast<ObjWrapper *>(stack->getUserData(index, *iter));
-				if (wrapper != nullptr){
-					return wrapper;
+			if (stack->is<LUA_TUSERDATA>(index) && lua_getmetatable(state.state, index) != 0){
+				stack->getField("typename", -1);
+				const char * typeName = lua_tostring(state.state, -1);
+				if (typeName != nullptr){
+					for (std::forward_list<std::string>::const_iterator iter = typeNames.begin(); iter != typeNames.end(); iter++){
+						if (strcmp(typeName, iter->c_str()) == 0){
+							wrapper = static_cast<ObjWrapper *>(stack->to<void *>(index));
+							break;
+						}
+					}
 				}
+				stack->pop(2);
 			}
-			
-			return nullptr;
+			return wrapper;
+		}
+
+		/*
+			Accepts objects of any listed type, type tags are obtained with getTypeTag().
+		*/
+		ObjWrapper * getWrapped(const int index, const std::forward_list<const void *> & typeTags){
+			State state = State(luaState, false);
+			Stack * stack = state.stack;
+			ObjWrapper * wrapper = nullptr;
+
+			if (stack->is<LUA_TUSERDATA>(index) && lua_getmetatable(state.state, index) != 0){
+				const void * objectMetatable = lua_topointer(state.state, -1);
+				for (std::forward_list<const void *>::const_iterator iter = typeTags.begin(); iter != typeTags.end(); iter++){
+					if (objectMetatable == *iter){
+						wrapper = static_cast<ObjWrapper *>(stack->to<void *>(index));
+						break;
+					}
+				}
+				stack->pop(1);
+			}
+			return wrapper;
 		}
 	private:
+		/*
+			Both __index and __newindex keep per-class key table in their first user upvalue.
+			Keys are interned Lua strings mapped either to a property slot number or to a cached method closure,
+			so a lookup doesn't construct or hash any C++ string.
+		*/
 		int index(State & state, C * object){
 			Stack * stack = state.stack;
 			if (stack->is<LUA_TNUMBER>(1)){
 				return operator_getArray(state, object);
 			}else if (stack->is<LUA_TSTRING>(1)){
-				const std::string key = stack->to<const std::string>(1);
-				stack->remove(1);
-				//traverse property and method maps
-				{
-					typename PropertyMap::iterator propertyIterator = properties.find(key);
-					if (propertyIterator != properties.end()){
-						PropertyPair & pair = propertyIterator->second;
-						return (this->*(pair.first))(state, object);
-					}
-					else{
-						typename MethodMap::iterator methodIterator = methods.find(key);
-						if (methodIterator != methods.end()){
-							Method & method = methodIterator->second;
-							stack->push<Function>([=, &state](State & state) -> int {
-								return (this->*(method))(state, object);
-							});
-							return 1;
-						}else{
-							return 0;
-						}
-					}
+				stack->getTable(stack->upvalueIndex(2));
+				if (stack->is<LUA_TNUMBER>(1)){
+					const int slot = stack->to<int>(1);
+					const PropertyPair & pair = propertySlots[slot];
+					stack->pop(1);
+#if defined(LUTOK2_PROFILING)
+					LUTOK2_PROFILE_SCOPE(propertyProfile[slot].first);
+#endif
+					return (this->*(pair.first))(state, object);
 				}
+				//method closure or nil
+				return 1;
 			}
 			return 0;
 		}
@@ -87,33 +132,43 @@ namespace lutok2 {
 				operator_setArray(state, object);
 				return 0;
 			}else if (stack->is<LUA_TSTRING>(1)){
-				const std::string key = stack->to<const std::string>(1);
-				stack->remove(1);
-				//traverse property map
-				{
-					typename PropertyMap::iterator propertyIterator = properties.find(key);
-					if (propertyIterator != properties.end()){
-						PropertyPair & pair = propertyIterator->second;
-						return (this->*(pair.second))(state, object);
-					}
-					else{
-						return 0;
-					}
+				stack->pushValue(1);
+				stack->getTable(stack->upvalueIndex(2));
+				if (stack->is<LUA_TNUMBER>(-1)){
+					const int slot = stack->to<int>(-1);
+					const PropertyPair & pair = propertySlots[slot];
+					stack->pop(1);
+					stack->remove(1);
+#if defined(LUTOK2_PROFILING)
+					LUTOK2_PROFILE_SCOPE(propertyProfile[slot].second);
+#endif
+					return (this->*(pair.second))(state, object);
 				}
 			}
 			return 0;
 		}
+		std::vector<PropertyPair> propertySlots;
+#if defined(LUTOK2_PROFILING)
+		std::vector<std::pair<ProfileEntry *, ProfileEntry *>> propertyProfile;
+#endif
 	public:
-		Object(Object & object){
-			this->state = object.state;
+		// metatable and its property slots are built for each instance, the copy prepares its own
+		Object(const Object & object){
+			this->luaState = object.luaState;
+			this->metatable = nullptr;
+			this->metatableRef = LUA_NOREF;
 			this->methods = object.methods;
 			this->properties = object.properties;
 		}
 		explicit Object(State * state){
 			this->luaState = state->state;
+			this->metatable = nullptr;
+			this->metatableRef = LUA_NOREF;
 		}
 		explicit Object(lua_State * state){
 			this->luaState = state;
+			this->metatable = nullptr;
+			this->metatableRef = LUA_NOREF;
 		}
 		virtual ~Object(){
 
@@ -128,16 +183,49 @@ namespace lutok2 {
 			return 0;
 		};
 
+		/*
+			Typed method and property wrappers - see LUTOK_BIND_METHOD and LUTOK_BIND_PROPERTY
+		*/
+		template<typename M, M method> int boundMethod(State & state, C * object){
+			typedef MethodBinding<M> Binding;
+			return Binding::invoke(state.state, object, method, 1, typename Binding::ArgumentIndices());
+		}
+
+		template<typename M, M getter> int boundGetter(State & state, C * object){
+			typedef MethodBinding<M> Binding;
+			return Binding::invoke(state.state, object, getter, 1, typename Binding::ArgumentIndices());
+		}
+
+		template<typename M, M setter> int boundSetter(State & state, C * object){
+			typedef MethodBinding<M> Binding;
+			Binding::invoke(state.state, object, setter, 1, typename Binding::ArgumentIndices());
+			return 0;
+		}
+
+		/*
+			Pushes class metatable into stack. It's built only once (usually by registerInterface),
+			later calls just fetch it by registry reference.
+		*/
 		void prepareMetatable(){
+			if (metatableRef != LUA_NOREF){
+				lua_rawgeti(luaState, LUA_REGISTRYINDEX, metatableRef);
+				return;
+			}
 			State state = State(luaState, false);
 			Stack * stack = state.stack;
 			const char * tname = typeid(C).name();
-			if (stack->newMetatable(tname)){
+			const bool created = stack->newMetatable(tname);
+			metatable = lua_topointer(state.state, -1);
+			stack->pushValue(-1);
+			metatableRef = stack->ref();
+			if (created){
 				stack->setField("typename", tname);
 				stack->setField<Function>("__gc", [this](State & state) -> int {
 					luaState = state.state;
 					ObjWrapper * wrapped = getWrapped(1);
-					if (wrapped->owned){
+					if (wrapped->inlined){
+						wrapped->instance->~C();
+					}else if (wrapped->owned){
 						destructor(state, wrapped->instance);
 					}
 					return 0;
@@ -149,19 +237,53 @@ namespace lutok2 {
 					return 1;
 				});
 
-				stack->setField<Function>("__index", [this](State & state) -> int {
+				//key table - method closures expect an object as their first argument (obj:method()), it's removed before the method is called
+				stack->newTable(0, static_cast<int>(methods.size() + properties.size()));
+				for (typename MethodMap::const_iterator iter = methods.begin(); iter != methods.end(); iter++){
+					const std::string & name = iter->first;
+					const Method method = iter->second;
+					stack->push<Function>([this, name, method](State & state) -> int {
+						luaState = state.state;
+						C * object = get(1);
+						if (object == nullptr){
+							state.error("Method %s expects %s object as its first argument", name.c_str(), typeid(C).name());
+							return 0;
+						}
+						state.stack->remove(1);
+						return (this->*(method))(state, object);
+					});
+					stack->setProfileName(-1, tname, name);
+					stack->setField(name);
+				}
+				//properties take precedence over methods with the same name
+				propertySlots.clear();
+#if defined(LUTOK2_PROFILING)
+				propertyProfile.clear();
+#endif
+				for (typename PropertyMap::const_iterator iter = properties.begin(); iter != properties.end(); iter++){
+					stack->push<int>(static_cast<int>(propertySlots.size()));
+					stack->setField(iter->first);
+					propertySlots.push_back(iter->second);
+#if defined(LUTOK2_PROFILING)
+					propertyProfile.push_back(std::make_pair(Profiler::getInstance().getEntry(tname, "get " + iter->first), Profiler::getInstance().getEntry(tname, "set " + iter->first)));
+#endif
+				}
+
+				stack->pushValue(-1);
+				stack->push(Function([this](State & state) -> int {
 					luaState = state.state;
 					C * object = get(1);
-					int t = state.stack->type(1);
 					state.stack->remove(1);
 					return index(state, object);
-				});
-				stack->setField<Function>("__newindex", [this](State & state) -> int {
+				}), 1);
+				stack->setField("__index", -3);
+				stack->push(Function([this](State & state) -> int {
 					luaState = state.state;
 					C * object = get(1);
 					state.stack->remove(1);
 					return newindex(state, object);
-				});
+				}), 1);
+				stack->setField("__newindex");
 
 				stack->setField<Function>("__add", [this](State & state) -> int {
 					luaState = state.state;
@@ -228,20 +350,44 @@ namespace lutok2 {
 						return retvals;
 					}
 				});
+#if defined(LUTOK2_PROFILING)
+				//name metamethods for profiler
+				stack->pushNil();
+				while (lua_next(state.state, -2) != 0){
+					if (stack->is<LUA_TSTRING>(-2)){
+						stack->setProfileName(-1, tname, stack->to<const std::string>(-2));
+					}
+					stack->pop(1);
+				}
+#endif
 			}
 		}
 
+		/*
+			Returns type tag of this class (nullptr until the first object is pushed)
+		*/
+		inline const void * getTypeTag() const {
+			return metatable;
+		}
+
 		void getConstructor(){
 			State state = State(luaState, false);
 			Stack * stack = state.stack;
+			prepareMetatable();
+			stack->pop(1);
 			stack->newTable();
 			//metatable
 				stack->newTable();
 				stack->setField<Function>("__call", [this](State & state) -> int {
 					state.stack->remove(1);
 					bool managed = true;
+					const int top = state.stack->getTop();
 					C * obj = constructor(state, managed);
 					if (obj != nullptr){
+						//constructor has already pushed the object with emplace
+						if (state.stack->getTop() > top && get(-1) == obj){
+							return 1;
+						}
 						push(obj, managed);
 						return 1;
 					}else{
@@ -253,13 +399,62 @@ namespace lutok2 {
 		}
 
 		void push(C * instance, const bool manage = false){
-			State state = State(luaState, false);
-			Stack * stack = state.stack;
-			ObjWrapper * wrapper = static_cast<ObjWrapper *>(stack->newUserData(sizeof(ObjWrapper)));
+			ObjWrapper * wrapper = static_cast<ObjWrapper *>(lua_newuserdata(luaState, sizeof(ObjWrapper)));
 			wrapper->instance = instance;
 			wrapper->owned = manage;
+			wrapper->inlined = false;
 			prepareMetatable();
-			stack->setMetatable();
+			lua_setmetatable(luaState, -2);
+		}
+
+		/*
+			Constructs an instance directly inside of Lua userdata and pushes it into stack.
+			There's no separate heap allocation, the instance is destroyed with ~C() when Lua collects it
+			(destructor() isn't called). Suitable for small value types (vectors, colors, handles).
+			Can be used inside of constructor() - just return the pointer.
+		*/
+		template<typename... Args> C * emplace(Args&&... args){
+			return emplaceSized(0, std::forward<Args>(args)...);
+		}
+
+		/*
+			Same as emplace, but reserves extraSize bytes right after the instance (see trailingStorage).
+			Used by objects with variable length data, e.g. Buffer.
+		*/
+		template<typename... Args> C * emplaceSized(const size_t extraSize, Args&&... args){
+			static_assert(alignof(C) <= alignof(double) || alignof(C) <= alignof(void *), "Inlined object alignment is stricter than Lua userdata alignment");
+			if (extraSize > maxExtraSize()){
+				luaL_error(luaState, "Object size is too large");
+				return nullptr;
+			}
+			char * block = static_cast<char *>(lua_newuserdata(luaState, inlineOffset() + trailingOffset() + extraSize));
+			ObjWrapper * wrapper = reinterpret_cast<ObjWrapper *>(block);
+			wrapper->instance = nullptr;
+			wrapper->owned = false;
+			wrapper->inlined = false;
+			//userdata has no metatable yet, so it's just discarded if the constructor throws
+			C * instance = new (block + inlineOffset()) C(std::forward<Args>(args)...);
+			wrapper->instance = instance;
+			wrapper->inlined = true;
+			prepareMetatable();
+			lua_setmetatable(luaState, -2);
+			return instance;
+		}
+
+		/*
+			Offset of extra bytes reserved by emplaceSized, relative to the instance. The storage is aligned for double.
+		*/
+		static inline size_t trailingOffset(){
+			return (sizeof(C) + alignof(double) - 1) / alignof(double) * alignof(double);
+		}
+
+		static inline void * trailingStorage(C * instance){
+			return reinterpret_cast<char *>(instance) + trailingOffset();
+		}
+
+		// the largest extraSize of emplaceSized that doesn't overflow the userdata size
+		static inline size_t maxExtraSize(){
+			return SIZE_MAX - inlineOffset() - trailingOffset();
 		}
 
 		C * get(const int index){
@@ -0,0 +1,259 @@
+#ifndef LUTOK2_PROFILER_H
+#define LUTOK2_PROFILER_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#if defined(_WIN32)
+#	ifndef WIN32_LEAN_AND_MEAN
+#		define WIN32_LEAN_AND_MEAN
+#	endif
+#	ifndef NOMINMAX
+#		define NOMINMAX
+#	endif
+#	include <windows.h>
+#else
+#	include <time.h>
+#endif
+
+namespace lutok2 {
+	/*
+		Call-level profiler of C++ bindings
+
+		Instrumentation is compiled in only when LUTOK2_PROFILING is defined (in every translation unit
+		that includes lutok2). It counts calls and accumulates wall and thread CPU time of:
+			- C++ functions (named by their first call site unless named explicitly),
+			- Object<C> metamethods and methods (category is the class name),
+			- Object<C> property getters and setters ("get key" and "set key").
+		Times are inclusive. Calls left with a Lua error (longjmp) are not recorded.
+		Statistics are process-wide and available as JSON or through lutok2.stats() in Lua.
+	*/
+	struct ProfileEntry {
+		std::string category;
+		std::string name;
+		std::atomic<uint64_t> calls;
+		std::atomic<uint64_t> wallTime;
+		std::atomic<uint64_t> cpuTime;
+
+		ProfileEntry(const std::string & category, const std::string & name) : category(category), name(name), calls(0), wallTime(0), cpuTime(0){
+		}
+	};
+
+	class Profiler {
+	private:
+		typedef std::map<std::pair<std::string, std::string>, std::unique_ptr<ProfileEntry>> EntryMap;
+		std::mutex mutex;
+		EntryMap entries;
+
+		static void appendJSONString(std::string & output, const std::string & value){
+			output += '"';
+			for (std::string::const_iterator iter = value.begin(); iter != value.end(); iter++){
+				const char c = *iter;
+				if (c == '"' || c == '\\'){
+					output += '\\';
+					output += c;
+				}else if (static_cast<unsigned char>(c) < 0x20){
+					char buffer[8];
+					snprintf(buffer, sizeof(buffer), "\\u%04x", static_cast<unsigned int>(c));
+					output += buffer;
+				}else{
+					output += c;
+				}
+			}
+			output += '"';
+		}
+
+		static int luaStats(lua_State * L){
+			getInstance().push(L);
+			return 1;
+		}
+
+		static int luaReset(lua_State * L){
+			LUTOK2_NOT_USED(L);
+			getInstance().reset();
+			return 0;
+		}
+	public:
+		static Profiler & getInstance(){
+			static Profiler profiler;
+			return profiler;
+		}
+
+		// nanoseconds of steady clock
+		static inline uint64_t wallClock(){
+			return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+
+		// nanoseconds of CPU time used by the current thread
+		static inline uint64_t cpuClock(){
+#if defined(_WIN32)
+			FILETIME creationTime, exitTime, kernelTime, userTime;
+			if (GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime)){
+				const uint64_t kernel = (static_cast<uint64_t>(kernelTime.dwHighDateTime) << 32) | kernelTime.dwLowDateTime;
+				const uint64_t user = (static_cast<uint64_t>(userTime.dwHighDateTime) << 32) | userTime.dwLowDateTime;
+				return (kernel + user) * 100;
+			}
+			return 0;
+#else
+			timespec time;
+			if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) == 0){
+				return static_cast<uint64_t>(time.tv_sec) * 1000000000ULL + static_cast<uint64_t>(time.tv_nsec);
+			}
+			return 0;
+#endif
+		}
+
+		/*
+			Returns counters of a name, entries are never removed so the pointer can be cached
+		*/
+		ProfileEntry * getEntry(const std::string & category, const std::string & name){
+			std::lock_guard<std::mutex> lock(mutex);
+			std::unique_ptr<ProfileEntry> & entry = entries[std::make_pair(category, name)];
+			if (!entry){
+				entry.reset(new ProfileEntry(category, name));
+			}
+			return entry.get();
+		}
+
+		void reset(){
+			std::lock_guard<std::mutex> lock(mutex);
+			for (EntryMap::const_iterator iter = entries.begin(); iter != entries.end(); iter++){
+				iter->second->calls = 0;
+				iter->second->wallTime = 0;
+				iter->second->cpuTime = 0;
+			}
+		}
+
+		/*
+			[{"category": ..., "name": ..., "calls": ..., "wall": ns, "cpu": ns}, ...] - entries without calls are left out
+		*/
+		std::string toJSON(){
+			std::lock_guard<std::mutex> lock(mutex);
+			std::string output = "[";
+			bool first = true;
+			for (EntryMap::const_iterator iter = entries.begin(); iter != entries.end(); iter++){
+				const ProfileEntry & entry = *iter->second;
+				if (entry.calls == 0){
+					continue;
+				}
+				output += (first) ? "\n\t{\"category\": " : ",\n\t{\"category\": ";
+				appendJSONString(output, entry.category);
+				output += ", \"name\": ";
+				appendJSONString(output, entry.name);
+				output += ", \"calls\": " + std::to_string(static_cast<unsigned long long>(entry.calls));
+				output += ", \"wall\": " + std::to_string(static_cast<unsigned long long>(entry.wallTime));
+				output += ", \"cpu\": " + std::to_string(static_cast<unsigned long long>(entry.cpuTime)) + "}";
+				first = false;
+			}
+			output += (first) ? "]" : "\n]";
+			return output;
+		}
+
+		/*
+			Pushes table {[category] = {[name] = {calls = n, wall = seconds, cpu = seconds}}}
+		*/
+		void push(lua_State * L){
+			std::lock_guard<std::mutex> lock(mutex);
+			lua_newtable(L);
+			for (EntryMap::const_iterator iter = entries.begin(); iter != entries.end(); iter++){
+				const ProfileEntry & entry = *iter->second;
+				if (entry.calls == 0){
+					continue;
+				}
+				lua_getfield(L, -1, entry.category.c_str());
+				if (lua_type(L, -1) != LUA_TTABLE){
+					lua_pop(L, 1);
+					lua_newtable(L);
+					lua_pushvalue(L, -1);
+					lua_setfield(L, -3, entry.category.c_str());
+				}
+				lua_createtable(L, 0, 3);
+				lua_pushnumber(L, static_cast<lua_Number>(entry.calls));
+				lua_setfield(L, -2, "calls");
+				lua_pushnumber(L, static_cast<lua_Number>(entry.wallTime) / 1e9);
+				lua_setfield(L, -2, "wall");
+				lua_pushnumber(L, static_cast<lua_Number>(entry.cpuTime) / 1e9);
+				lua_setfield(L, -2, "cpu");
+				lua_setfield(L, -2, entry.name.c_str());
+				lua_pop(L, 1);
+			}
+		}
+
+		/*
+			Registers lutok2.stats() and lutok2.resetStats() in Lua state
+		*/
+		static void open(lua_State * L){
+			lua_getglobal(L, "lutok2");
+			if (lua_type(L, -1) != LUA_TTABLE){
+				lua_pop(L, 1);
+				lua_newtable(L);
+				lua_pushvalue(L, -1);
+				lua_setglobal(L, "lutok2");
+			}
+			lua_pushcfunction(L, luaStats);
+			lua_setfield(L, -2, "stats");
+			lua_pushcfunction(L, luaReset);
+			lua_setfield(L, -2, "resetStats");
+			lua_pop(L, 1);
+		}
+
+		/*
+			Profiler entry slot stored after Function object in closure userdata (see Stack::newFunction)
+		*/
+		static inline ProfileEntry ** functionEntrySlot(Function * function){
+			return reinterpret_cast<ProfileEntry **>(reinterpret_cast<char *>(function) + functionEntryOffset());
+		}
+
+		static inline size_t functionEntryOffset(){
+			return (sizeof(Function) + alignof(ProfileEntry *) - 1) / alignof(ProfileEntry *) * alignof(ProfileEntry *);
+		}
+
+		/*
+			Returns entry of C++ function called from Lua, unnamed functions get the name of their first call site
+		*/
+		static ProfileEntry * functionEntry(lua_State * L, Function * function){
+			ProfileEntry ** slot = functionEntrySlot(function);
+			if (*slot == nullptr){
+				lua_Debug info;
+				const char * name = nullptr;
+				if (lua_getstack(L, 0, &info) != 0 && lua_getinfo(L, "n", &info) != 0){
+					name = info.name;
+				}
+				*slot = getInstance().getEntry("function", (name != nullptr) ? name : "?");
+			}
+			return *slot;
+		}
+	};
+
+	/*
+		Adds time between construction and destruction to profiler entry
+	*/
+	class ProfileScope {
+	private:
+		ProfileEntry * entry;
+		uint64_t wallStart;
+		uint64_t cpuStart;
+
+		ProfileScope(const ProfileScope &);
+		ProfileScope & operator= (const ProfileScope &);
+	public:
+		explicit ProfileScope(ProfileEntry * entry) : entry(entry), wallStart(Profiler::wallClock()), cpuStart(Profiler::cpuClock()){
+		}
+		~ProfileScope(){
+			entry->calls.fetch_add(1, std::memory_order_relaxed);
+			entry->wallTime.fetch_add(Profiler::wallClock() - wallStart, std::memory_order_relaxed);
+			entry->cpuTime.fetch_add(Profiler::cpuClock() - cpuStart, std::memory_order_relaxed);
+		}
+	};
+
+#if defined(LUTOK2_PROFILING)
+#	define LUTOK2_PROFILE_SCOPE(ENTRY) lutok2::ProfileScope profileScope(ENTRY)
+#	define LUTOK2_FUNCTION_EXTRA_SIZE (lutok2::Profiler::functionEntryOffset() - sizeof(lutok2::Function) + sizeof(lutok2::ProfileEntry *))
+#else
+#	define LUTOK2_PROFILE_SCOPE(ENTRY)
+#	define LUTOK2_FUNCTION_EXTRA_SIZE 0
+#endif
+};
+
+#endif
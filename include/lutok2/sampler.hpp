@@ -0,0 +1,254 @@
+#ifndef LUTOK2_SAMPLER_H
+#define LUTOK2_SAMPLER_H
+
+#include <map>
+#include <chrono>
+
+namespace lutok2 {
+	/*
+		Sampling profiler of Lua scripts
+
+		Installs a count hook which records a stack sample every N executed instructions (optionally
+		no more often than once per period). Samples go into a preallocated ring buffer, frames are
+		stored as indexes into a fixed size label table, so the hook doesn't allocate any memory.
+		Samples are aggregated into folded stacks ("outer;inner;leaf count") used by flamegraph tools.
+
+		The hook is set on the state passed to the profiler; coroutines created afterwards inherit it.
+	*/
+	class SamplingProfiler {
+	public:
+		static const size_t labelCapacity = 4096;
+		static const size_t labelLength = 96;
+	private:
+		struct Label {
+			uint64_t hash;
+			bool used;
+			char text[labelLength];
+		};
+
+		struct Sample {
+			size_t firstFrame;
+			int depth;
+		};
+
+		lua_State * state;
+		const int maxDepth;
+		std::vector<Sample> samples;
+		std::vector<uint32_t> frames;
+		std::vector<Label> labels;
+		size_t nextSample;
+		size_t sampleCount;
+		size_t droppedSamples;
+		size_t labelCount;
+		bool running;
+		std::chrono::steady_clock::duration period;
+		std::chrono::steady_clock::time_point lastSample;
+
+		SamplingProfiler(const SamplingProfiler &);
+		SamplingProfiler & operator= (const SamplingProfiler &);
+
+		static inline void * profilerKey(){
+			static char key = 0;
+			return &key;
+		}
+
+		static uint64_t hash(const char * text, uint64_t value){
+			for (; *text != '\0'; text++){
+				value ^= static_cast<unsigned char>(*text);
+				value *= 1099511628211ULL;
+			}
+			return value;
+		}
+
+		/*
+			Returns label index of a frame, label text is copied only when the frame is seen for the first time.
+			The last label slot is reserved for frames which don't fit into the table.
+			C functions are labeled by the name they were called by, so labels are the same in every run.
+			Addresses are used only for unnamed ones, bound C++ functions are told apart by the wrapped Function.
+		*/
+		uint32_t labelIndex(const lua_Debug & info, lua_CFunction function, const void * wrapped){
+			char text[labelLength];
+			if ((wrapped != nullptr || function != nullptr) && info.name != nullptr){
+				snprintf(text, sizeof(text), "%s:%s", (wrapped != nullptr) ? "[C++]" : "[C]", info.name);
+			}else if (wrapped != nullptr){
+				snprintf(text, sizeof(text), "[C++]:%p", wrapped);
+			}else if (function != nullptr){
+				snprintf(text, sizeof(text), "[C]:%p", reinterpret_cast<void *>(function));
+			}else if (*info.what == 'm'){
+				snprintf(text, sizeof(text), "%s:main", info.short_src);
+			}else{
+				snprintf(text, sizeof(text), "%s:%d", info.short_src, info.linedefined);
+			}
+			// short_src of string chunks is the source text, ';' would split the frame in folded stacks
+			for (char * c = text; *c != '\0'; c++){
+				if (*c == ';' || static_cast<unsigned char>(*c) < 0x20 || *c == 0x7f){
+					*c = '_';
+				}
+			}
+			const uint64_t value = hash(text, 14695981039346656037ULL);
+			const size_t mask = labelCapacity - 1;
+			for (size_t i = 0, slot = static_cast<size_t>(value) & mask; i < labelCapacity - 1; i++, slot = (slot + 1) & mask){
+				if (slot == labelCapacity - 1){
+					continue;
+				}
+				Label & label = labels[slot];
+				if (!label.used){
+					if (labelCount >= labelCapacity / 2){
+						break;
+					}
+					label.used = true;
+					label.hash = value;
+					memcpy(label.text, text, labelLength);
+					labelCount++;
+					return static_cast<uint32_t>(slot);
+				}
+				if (label.hash == value && strcmp(label.text, text) == 0){
+					return static_cast<uint32_t>(slot);
+				}
+			}
+			return static_cast<uint32_t>(labelCapacity - 1);
+		}
+
+		void takeSample(lua_State * L){
+			if (period.count() > 0){
+				const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+				if (now - lastSample < period){
+					return;
+				}
+				lastSample = now;
+			}
+			if (sampleCount >= samples.size()){
+				droppedSamples++;
+			}else{
+				sampleCount++;
+			}
+			Sample & sample = samples[nextSample];
+			sample.firstFrame = nextSample * static_cast<size_t>(maxDepth);
+			sample.depth = 0;
+			nextSample = (nextSample + 1) % samples.size();
+
+			lua_Debug info;
+			for (int level = 0; sample.depth < maxDepth && lua_getstack(L, level, &info) != 0; level++){
+				lua_getinfo(L, "nSf", &info);
+				lua_CFunction function = (*info.what == 'C') ? lua_tocfunction(L, -1) : nullptr;
+				const void * wrapped = nullptr;
+				if (function == cxx_function_wrapper && lua_getupvalue(L, -1, 1) != nullptr){
+					wrapped = lua_touserdata(L, -1);
+					lua_pop(L, 1);
+				}
+				lua_pop(L, 1);
+				frames[sample.firstFrame + sample.depth] = labelIndex(info, function, wrapped);
+				sample.depth++;
+			}
+		}
+
+		static void hook(lua_State * L, lua_Debug * info){
+			LUTOK2_NOT_USED(info);
+			lua_pushlightuserdata(L, profilerKey());
+			lua_rawget(L, LUA_REGISTRYINDEX);
+			SamplingProfiler * profiler = static_cast<SamplingProfiler *>(lua_touserdata(L, -1));
+			lua_pop(L, 1);
+			if (profiler != nullptr){
+				profiler->takeSample(L);
+			}
+		}
+	public:
+		/*
+			capacity - number of samples kept in the ring buffer (older samples are overwritten)
+			maxDepth - number of innermost frames recorded per sample
+		*/
+		explicit SamplingProfiler(State & state, const size_t capacity = 10000, const int maxDepth = 32)
+			: state(state.state), maxDepth(maxDepth), samples(capacity > 0 ? capacity : 1), labels(labelCapacity){
+			frames.resize(samples.size() * static_cast<size_t>(maxDepth));
+			nextSample = 0;
+			sampleCount = 0;
+			droppedSamples = 0;
+			labelCount = 0;
+			running = false;
+			period = std::chrono::steady_clock::duration::zero();
+			Label & overflow = labels[labelCapacity - 1];
+			overflow.used = true;
+			overflow.hash = 0;
+			strcpy(overflow.text, "(other)");
+		}
+
+		~SamplingProfiler(){
+			stop();
+		}
+
+		/*
+			Starts sampling every instructions executed Lua VM instructions.
+			If periodMicroseconds isn't zero, samples are taken at most once per period.
+		*/
+		void start(const int instructions = 1000, const unsigned int periodMicroseconds = 0){
+			stop();
+			period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::microseconds(periodMicroseconds));
+			lastSample = std::chrono::steady_clock::now();
+			lua_pushlightuserdata(state, profilerKey());
+			lua_pushlightuserdata(state, this);
+			lua_rawset(state, LUA_REGISTRYINDEX);
+			lua_sethook(state, hook, LUA_MASKCOUNT, (instructions > 0) ? instructions : 1);
+			running = true;
+		}
+
+		void stop(){
+			if (running){
+				if (lua_gethook(state) == hook){
+					lua_sethook(state, nullptr, 0, 0);
+				}
+				lua_pushlightuserdata(state, profilerKey());
+				lua_pushnil(state);
+				lua_rawset(state, LUA_REGISTRYINDEX);
+				running = false;
+			}
+		}
+
+		inline bool isRunning() const {
+			return running;
+		}
+
+		// number of samples in the ring buffer
+		inline size_t getSampleCount() const {
+			return sampleCount;
+		}
+
+		// number of overwritten samples
+		inline size_t getDroppedSamples() const {
+			return droppedSamples;
+		}
+
+		void clear(){
+			nextSample = 0;
+			sampleCount = 0;
+			droppedSamples = 0;
+		}
+
+		/*
+			Aggregates samples into folded stacks, one "outer;...;inner count" line per unique stack
+		*/
+		std::string getFoldedStacks() const {
+			std::map<std::string, size_t> stacks;
+			const size_t first = (sampleCount < samples.size()) ? 0 : nextSample;
+			for (size_t i = 0; i < sampleCount; i++){
+				const Sample & sample = samples[(first + i) % samples.size()];
+				std::string stack;
+				for (int frame = sample.depth - 1; frame >= 0; frame--){
+					if (!stack.empty()){
+						stack += ';';
+					}
+					stack += labels[frames[sample.firstFrame + frame]].text;
+				}
+				if (!stack.empty()){
+					stacks[stack]++;
+				}
+			}
+			std::string output;
+			for (std::map<std::string, size_t>::const_iterator iter = stacks.begin(); iter != stacks.end(); iter++){
+				output += iter->first + " " + std::to_string(static_cast<unsigned long long>(iter->second)) + "\n";
+			}
+			return output;
+		}
+	};
+};
+
+#endif
@@ -5,6 +5,25 @@ namespace lutok2 {
 	class State;
 	class StackDebugger;
 
+	/*
+		Status of Stack::tryCall
+
+		On failure the error message stays on top of the stack, message refers into it
+		and remains valid until it's popped. Traceback is formatted only when it's read.
+	*/
+	struct CallResult {
+		int status;
+		StringRef message;
+		Traceback traceback;
+
+		inline bool ok() const {
+			return status == 0;
+		}
+		inline explicit operator bool() const {
+			return status == 0;
+		}
+	};
+
 	class Stack {
 	private:
 		lua_State ** state;
@@ -53,7 +72,7 @@ namespace lutok2 {
 		}
 
 		inline void insert(int index){
-			lua_replace(*state, index);
+			lua_insert(*state, index);
 		}
 
 		inline void replace(int index){
@@ -133,18 +152,83 @@ namespace lutok2 {
 		template<typename T> inline T to(const int index = -1);
 		template<typename T> inline void setField(const std::string & name, T value, const int index = -2);
 
+		/*
+			The wrapped function always occupies upvalue 1 so cxx_function_wrapper can fetch it directly,
+			user upvalues are accessible at upvalueIndex(2) .. upvalueIndex(n + 1).
+		*/
 		inline void push(Function value, int n){
-			Function ** wrappedFunction = static_cast<Function **>(newUserData(sizeof(Function*)));
-			*wrappedFunction = new Function(value);
+			newFunction(value);
+			lua_insert(*state, -(n + 1));
 			pushClosure(cxx_function_wrapper, n + 1);
 		}
 
 		inline void push(cxx_function value, int n){
-			Function ** wrappedFunction = static_cast<Function **>(newUserData(sizeof(Function*)));
-			*wrappedFunction = new Function(value);
+			newFunction(value);
+			lua_insert(*state, -(n + 1));
 			pushClosure(cxx_function_wrapper, n + 1);
 		}
 
+		/*
+			Function object is constructed in-place inside of userdata and destroyed by its __gc metamethod.
+			Metatable is shared by all functions and cached in registry under a light userdata key.
+		*/
+		inline Function * newFunction(const Function & value){
+			Function * wrappedFunction = static_cast<Function *>(newUserData(sizeof(Function) + LUTOK2_FUNCTION_EXTRA_SIZE));
+			new (wrappedFunction) Function(value);
+#if defined(LUTOK2_PROFILING)
+			*Profiler::functionEntrySlot(wrappedFunction) = nullptr;
+#endif
+
+			lua_pushlightuserdata(*state, functionMetatableKey());
+			lua_rawget(*state, LUA_REGISTRYINDEX);
+			if (!is<LUA_TTABLE>()){
+				pop(1);
+				newTable(0, 1);
+				lua_pushcfunction(*state, cxx_function_gc);
+				setField("__gc");
+				lua_pushlightuserdata(*state, functionMetatableKey());
+				pushValue(-2);
+				lua_rawset(*state, LUA_REGISTRYINDEX);
+			}
+			setMetatable(-2);
+			return wrappedFunction;
+		}
+
+		/*
+			Names C++ function at index for profiler, does nothing unless LUTOK2_PROFILING is defined
+		*/
+		inline void setProfileName(const int index, const std::string & category, const std::string & name){
+#if defined(LUTOK2_PROFILING)
+			if (lua_tocfunction(*state, index) == cxx_function_wrapper && lua_getupvalue(*state, index, 1) != nullptr){
+				Function * function = static_cast<Function *>(lua_touserdata(*state, -1));
+				if (function != nullptr){
+					*Profiler::functionEntrySlot(function) = Profiler::getInstance().getEntry(category, name);
+				}
+				pop(1);
+			}
+#else
+			LUTOK2_NOT_USED(index);
+			LUTOK2_NOT_USED(category);
+			LUTOK2_NOT_USED(name);
+#endif
+		}
+
+		static inline void * functionMetatableKey(){
+			static char key = 0;
+			return &key;
+		}
+
+		/*
+			Pushes a C++ function with arbitrary signature, arguments and return value
+			are converted automatically. Use LUTOK_FUNCTION to avoid storing function pointer in upvalue.
+		*/
+		template<typename R, typename... Args> inline void bind(R (*fn)(Args...)){
+			typedef R (*FunctionType)(Args...);
+			FunctionType * storage = static_cast<FunctionType *>(newUserData(sizeof(FunctionType)));
+			*storage = fn;
+			pushClosure(FunctionBinding<FunctionType>::callUpvalue, 1);
+		}
+
 		inline void pushClosure(lua_CFunction fn, int n){
 			lua_pushcclosure(*state, fn, n);
 		}
@@ -157,6 +241,10 @@ namespace lutok2 {
 			lua_pushlstring(*state, value.c_str(), value.length());
 		}
 
+		inline void pushLString(const char * value, const size_t len){
+			lua_pushlstring(*state, value, len);
+		}
+
 		inline void pushVFString(const char * fmt, ...){
 			char buffer[1024];
 			va_list args;
@@ -182,6 +270,15 @@ namespace lutok2 {
 			lua_pushvalue(*state, index);
 		}
 
+		/*
+			Returns a reference to the string without copying, it's valid while the value stays on the stack
+		*/
+		inline StringRef toStringRef(const int index = -1){
+			size_t len = 0;
+			const char * value = lua_tolstring(*state, index, &len);
+			return StringRef(value, len);
+		}
+
 		inline std::string toLString(const int index = -1){
 			size_t len = 0;
 			const char * tmpString = lua_tolstring(*state, index, &len);
@@ -206,7 +303,7 @@ namespace lutok2 {
 			lua_Writer fn = [](lua_State *L, const void* p, size_t sz, void* ud) -> int {
 				std::string * buffer = reinterpret_cast<std::string *>(ud);
 				const char * data = reinterpret_cast<const char*>(p);
-				buffer->append(std::string(data, sz));
+				buffer->append(data, sz);
 				return 0;
 			};
 
@@ -279,6 +376,20 @@ namespace lutok2 {
 			}
 		}
 
+		/*
+			Checks userdata type by metatable identity, metatable pointer is obtained with lua_topointer.
+		*/
+		inline void * getUserDataByMetatable(const int narg, const void * metatable){
+			if (lua_type(*state, narg) == LUA_TUSERDATA && lua_getmetatable(*state, narg) != 0){
+				const bool matches = (lua_topointer(*state, -1) == metatable);
+				lua_pop(*state, 1);
+				if (matches){
+					return lua_touserdata(*state, narg);
+				}
+			}
+			return nullptr;
+		}
+
 		/*
 			Metatables
 		*/
@@ -311,7 +422,90 @@ namespace lutok2 {
 			lua_call(*state, nargs, nresults);
 		}
 
+		/*
+			Calls a function in protected mode without throwing C++ exceptions.
+			Results are left on the stack on success, error message (with traceback if requested) on failure.
+			Traceback is produced by a message handler which is created once per Lua state and cached in registry.
+		*/
+		CallResult tryCall(const int nargs, const int nresults, const bool traceback = false){
+			CallResult result;
+			clearTraceback();
+			int handlerIndex = 0;
+			if (traceback){
+				handlerIndex = lua_gettop(*state) - nargs;
+				pushMessageHandler();
+				lua_insert(*state, handlerIndex);
+			}
+			result.status = lua_pcall(*state, nargs, nresults, handlerIndex);
+			if (traceback){
+				lua_remove(*state, handlerIndex);
+			}
+			if (result.status != 0){
+				result.message = toStringRef(-1);
+				if (traceback){
+					result.traceback = lastTraceback();
+				}
+			}
+			return result;
+		}
+
+		/*
+			Pushes cached message handler which captures stack frames of errors (see lastTraceback).
+			It's created once per Lua state and can be used as errFunction of pcall as well.
+		*/
+		void pushMessageHandler(){
+			lua_pushlightuserdata(*state, messageHandlerKey());
+			lua_rawget(*state, LUA_REGISTRYINDEX);
+			if (!is<LUA_TFUNCTION>()){
+				pop(1);
+				lua_pushcfunction(*state, messageHandler);
+				lua_pushlightuserdata(*state, messageHandlerKey());
+				pushValue(-2);
+				lua_rawset(*state, LUA_REGISTRYINDEX);
+			}
+		}
+
+		/*
+			Returns traceback captured by the message handler during the last failed call
+		*/
+		Traceback lastTraceback(){
+			lua_pushlightuserdata(*state, tracebackKey());
+			lua_rawget(*state, LUA_REGISTRYINDEX);
+			clearTraceback();
+			return Traceback::fromFrames(*state);
+		}
+
+		/*
+			Releases frames stored by the message handler, every call does it first
+			so frames of an error nobody asked for are kept only until the next call
+		*/
+		inline void clearTraceback(){
+			lua_pushlightuserdata(*state, tracebackKey());
+			lua_pushnil(*state);
+			lua_rawset(*state, LUA_REGISTRYINDEX);
+		}
+
+		static inline void * messageHandlerKey(){
+			static char key = 0;
+			return &key;
+		}
+
+		static inline void * tracebackKey(){
+			static char key = 0;
+			return &key;
+		}
+
+		// error message is returned unchanged, frames are only recorded
+		static int messageHandler(lua_State * L){
+			lua_pushlightuserdata(L, tracebackKey());
+			Traceback::pushFrames(L, 1, Traceback::defaultDepth);
+			lua_rawset(L, LUA_REGISTRYINDEX);
+			lua_settop(L, 1);
+			return 1;
+		}
+
 		void pcall(const int nargs, const int nresults, const int errFunction = 0){
+			clearTraceback();
 			int result = lua_pcall(*state, nargs, nresults, errFunction);
 			if (result != 0){
 				const std::string errMessage = lua_tostring(*state, -1);
@@ -349,8 +543,15 @@ namespace lutok2 {
 
 	/*
 		push methods
+
+		Types without explicit specialization (other numeric types, std::string, containers, pairs and tuples)
+		are converted by StackValue. Use a reference type to avoid copying containers: push<const std::vector<double> &>(values)
 	*/
 
+	template<typename T> inline void Stack::push(T value){
+		StackValue<typename std::decay<T>::type>::push(*state, value);
+	}
+
 	template<> inline void Stack::push(int value){
 		lua_pushinteger(*state, value);
 	}
@@ -376,8 +577,7 @@ namespace lutok2 {
 	}
 
 	template<> inline void Stack::push(Function value){
-		Function ** wrappedFunction = static_cast<Function **>(newUserData(sizeof(Function*)));
-		*wrappedFunction = new Function(value);
+		newFunction(value);
 		pushClosure(cxx_function_wrapper, 1);
 	}
 
@@ -386,8 +586,7 @@ namespace lutok2 {
 	}
 
 	template<> inline void Stack::push(cxx_function value){
-		Function ** wrappedFunction = static_cast<Function **>(newUserData(sizeof(Function*)));
-		*wrappedFunction = new Function(value);
+		newFunction(value);
 		pushClosure(cxx_function_wrapper, 1);
 	}
 
@@ -395,6 +594,10 @@ namespace lutok2 {
 		to methods
 	*/
 
+	template<typename T> inline T Stack::to(const int index){
+		return StackValue<typename std::decay<T>::type>::get(*state, index);
+	}
+
 	template<> inline bool Stack::to(const int index){
 		return lua_toboolean(*state, index) == 1;
 	}
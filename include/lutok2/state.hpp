@@ -5,8 +5,35 @@ namespace lutok2 {
 	class StackDebugger;
 	class BaseObject;
 
+	/*
+		Assigns a small sequential number to each interface class at first use
+	*/
+	class InterfaceIndex {
+	private:
+		static size_t next(){
+			static std::atomic<size_t> counter(0);
+			return counter++;
+		}
+	public:
+		template<class C> static size_t get(){
+			static const size_t index = next();
+			return index;
+		}
+	};
+
+	/*
+		Per Lua state data, stored as userdata in Lua registry and released when Lua state is closed.
+	*/
 	struct StateData {
 		std::unordered_map<std::string, BaseObject*> interfaces;
+		std::vector<BaseObject*> typedInterfaces;
+		std::vector<BaseObject*> ownedInterfaces;
+
+		~StateData(){
+			for (std::vector<BaseObject*>::iterator iter = ownedInterfaces.begin(); iter != ownedInterfaces.end(); iter++){
+				delete (*iter);
+			}
+		}
 	};
 
 	class State {
@@ -17,6 +44,7 @@ namespace lutok2 {
 		lua_State * originalState;
 	private:
 		bool owned;
+		Stack localStack;
 
 		inline const char * findTable(const int index, const std::string & name, int szHint){
 			return luaL_findtable(state, index, name.c_str(), szHint);
@@ -43,6 +71,15 @@ namespace lutok2 {
 			initState(lua_managed);
 		}
 
+		/*
+			Creates a new Lua state which uses custom memory allocator (e.g. PoolAllocator::alloc).
+		*/
+		State(lua_Alloc allocator, void * userData, bool lua_managed = false){
+			originalState = nullptr;
+			newState(allocator, userData);
+			initState(lua_managed);
+		}
+
 		explicit State(lua_State * state, bool lua_managed = true){
 			this->state = state;
 			originalState = nullptr;
@@ -50,11 +87,20 @@ namespace lutok2 {
 			initState(lua_managed);
 		}
 
+		/*
+			A copy is always a non-owning view of the same Lua state.
+		*/
+		State(const State & arg){
+			state = arg.state;
+			originalState = arg.originalState;
+			owned = false;
+			initState(false);
+		}
+
 		~State(){
 			if (owned){
 				closeState();
 			}
-			delete stack;
 		}
 
 		State & operator= (State & arg){
@@ -77,7 +123,9 @@ namespace lutok2 {
 		*/
 
 		void initState(bool lua_managed = false){
-			stack = new Stack(&state, &originalState, this);
+			// Stack is embedded, so a State view on a C stack frame costs no heap allocation
+			localStack = Stack(&state, &originalState, this);
+			stack = &localStack;
 			/*
 			if (lua_managed){
 				getCurrentState(this);
@@ -86,17 +134,65 @@ namespace lutok2 {
 		}
 
 		void newState(){
-			state = luaL_newstate();
+			newState(AccountingAllocator::defaultAlloc, nullptr);
+		}
+
+		void newState(lua_Alloc allocator, void * userData){
+			AccountingAllocator * accounting = new AccountingAllocator(allocator, userData);
+			state = lua_newstate(AccountingAllocator::alloc, accounting);
 			owned = true;
+			if (state == nullptr){
+				delete accounting;
+				// LuaJIT on x64 doesn't support custom allocators - memory accounting is not available there
+				if (allocator == AccountingAllocator::defaultAlloc){
+					state = luaL_newstate();
+				}
+				if (state == nullptr){
+					throw std::bad_alloc();
+				}
+			}else{
+				lua_atpanic(state, panic);
+			}
+		}
+
+		// same behaviour as panic function installed by luaL_newstate
+		static int panic(lua_State * L){
+			fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+			return 0;
 		}
 
 		void closeState(){
 			if (state != nullptr){
+				AccountingAllocator * accounting = AccountingAllocator::get(state);
 				lua_close(state);
+				delete accounting;
 				state = nullptr;
 			}
 		}
 
+		/*
+			Memory accounting - available only for Lua states created by State
+		*/
+
+		const MemoryUsage getMemoryUsage(){
+			AccountingAllocator * accounting = AccountingAllocator::get(state);
+			if (accounting != nullptr){
+				return accounting->usage;
+			}else{
+				MemoryUsage usage = {static_cast<size_t>(lua_gc(state, LUA_GCCOUNT, 0)) * 1024 + static_cast<size_t>(lua_gc(state, LUA_GCCOUNTB, 0)), 0, 0};
+				return usage;
+			}
+		}
+
+		bool setMemoryLimit(const size_t limit){
+			AccountingAllocator * accounting = AccountingAllocator::get(state);
+			if (accounting != nullptr){
+				accounting->usage.limit = limit;
+				return true;
+			}
+			return false;
+		}
+
 		void openLibs(){
 			luaL_openlibs(state);
 		}
@@ -105,50 +201,70 @@ namespace lutok2 {
 			Loaders
 		*/
 
-		void loadFile(const std::string & fileName){
-			int rc = luaL_loadfile(state, fileName.c_str());
-			if (rc != 0){
-				std::string errorMessage;
+		void throwLoadError(const int rc, const std::string & fileName){
+			std::string errorMessage;
 
-				if (rc == LUA_ERRSYNTAX){
-					errorMessage = "Syntax error";
-				}
-				else if (rc == LUA_ERRMEM){
-					errorMessage = "Memory allocation error";
-				}
-				else if (rc == LUA_ERRFILE){
-					errorMessage = "Can't open file: " + fileName;
-				}
-				else{
-					errorMessage = "Unknown error";
+			if (rc == LUA_ERRSYNTAX){
+				errorMessage = "Syntax error";
+			}
+			else if (rc == LUA_ERRMEM){
+				errorMessage = "Memory allocation error";
+			}
+			else if (rc == LUA_ERRFILE){
+				errorMessage = "Can't open file: " + fileName;
+			}
+			else{
+				errorMessage = "Unknown error";
+			}
+			if (lua_type(state, -1) == LUA_TSTRING){
+				const char * luaMessage = lua_tostring(state, -1);
+				errorMessage = errorMessage + "\n" + luaMessage;
+			}
+			throw std::runtime_error(errorMessage);
+		}
+
+		/*
+			Script files are memory mapped and passed to Lua parser directly.
+			Files which can't be mapped (e.g. pipes or empty files) are read by luaL_loadfile.
+		*/
+		void loadFile(const std::string & fileName){
+			MappedFile file(fileName);
+			const char * data = file.getData();
+			size_t length = file.getLength();
+
+			if (data != nullptr){
+				// skip the first line starting with # (unix exec. file) the same way luaL_loadfile does
+				if (data[0] == '#'){
+					const char * lineEnd = static_cast<const char *>(memchr(data, '\n', length));
+					const size_t skip = (lineEnd != nullptr) ? static_cast<size_t>(lineEnd - data) : length;
+					data += skip;
+					length -= skip;
+					// line break is kept for source code so line numbers stay the same
+					if (length > 1 && data[1] == LUA_SIGNATURE[0]){
+						data++;
+						length--;
+					}
 				}
-				if (lua_type(state, -1) == LUA_TSTRING){
-					const char * luaMessage = lua_tostring(state, -1);
-					errorMessage = errorMessage + "\n" + luaMessage;
+				loadBuffer(data, length, "@" + fileName);
+			}else{
+				int rc = luaL_loadfile(state, fileName.c_str());
+				if (rc != 0){
+					throwLoadError(rc, fileName);
 				}
-				throw std::runtime_error(errorMessage);
 			}
 		}
 
 		void loadString(const std::string & chunk, const std::string & chunkName = ""){
-			int rc = luaL_loadbuffer(state, chunk.c_str(), chunk.length(), chunkName.c_str());
-			if (rc != 0){
-				std::string errorMessage;
+			loadBuffer(chunk.c_str(), chunk.length(), chunkName);
+		}
 
-				if (rc == LUA_ERRSYNTAX){
-					errorMessage = "Syntax error";
-				}
-				else if (rc == LUA_ERRMEM){
-					errorMessage = "Memory allocation error";
-				}
-				else{
-					errorMessage = "Unknown error";
-				}
-				if (lua_type(state, -1) == LUA_TSTRING){
-					const char * luaMessage = lua_tostring(state, -1);
-					errorMessage = errorMessage + "\n" + luaMessage;
-				}
-				throw std::runtime_error(errorMessage);
+		/*
+			Loads Lua source code or bytecode from memory buffer without copying it.
+		*/
+		void loadBuffer(const char * buffer, const size_t length, const std::string & chunkName = ""){
+			int rc = luaL_loadbuffer(state, buffer, length, chunkName.c_str());
+			if (rc != 0){
+				throwLoadError(rc, chunkName);
 			}
 		}
 
@@ -163,6 +279,7 @@ namespace lutok2 {
 				iter = members.begin(); iter != members.end(); iter++) {
 					stack->push<const std::string &>((*iter).first);
 					stack->push<cxx_function>((*iter).second);
+					stack->setProfileName(-1, "function", (*iter).first);
 					stack->setTable(-3);
 			}
 		}
@@ -193,34 +310,75 @@ namespace lutok2 {
 			Class interfaces
 		*/
 
-		static StateData * getLocalStateData(){
-			static __thread_local StateData * localStateData = nullptr;
-			if (!localStateData) {
-				localStateData = new StateData;
+		static inline void * stateDataKey(){
+			static char key = 0;
+			return &key;
+		}
+
+		StateData * getStateData(){
+			lua_pushlightuserdata(state, stateDataKey());
+			lua_rawget(state, LUA_REGISTRYINDEX);
+			StateData * stateData = static_cast<StateData *>(lua_touserdata(state, -1));
+			lua_pop(state, 1);
+
+			if (stateData == nullptr){
+				lua_pushlightuserdata(state, stateDataKey());
+				stateData = static_cast<StateData *>(lua_newuserdata(state, sizeof(StateData)));
+				new (stateData) StateData();
+				lua_createtable(state, 0, 1);
+				lua_pushcfunction(state, free_state_data);
+				lua_setfield(state, -2, "__gc");
+				lua_setmetatable(state, -2);
+				lua_rawset(state, LUA_REGISTRYINDEX);
 			}
-			return localStateData;
+			return stateData;
 		}
 
+		/*
+			Interface objects are stored within Lua state and released with it
+		*/
 		template<class C> void registerInterface(const std::string & name){
-			BaseObject * _interface = new C(this);
-			StateData * localStateData = getLocalStateData();
-			localStateData->interfaces[name] = _interface;
+			C * _interface = new C(this);
+			StateData * stateData = getStateData();
+			stateData->ownedInterfaces.push_back(_interface);
+			stateData->interfaces[name] = _interface;
+
+			const size_t index = InterfaceIndex::get<C>();
+			if (stateData->typedInterfaces.size() <= index){
+				stateData->typedInterfaces.resize(index + 1, nullptr);
+			}
+			stateData->typedInterfaces[index] = _interface;
 			_interface->getConstructor();
 		}
 
+		/*
+			Interface object remains owned by caller
+		*/
 		void registerInterface(const std::string & name, BaseObject * _interface){
-			StateData * localStateData = getLocalStateData();
-			localStateData->interfaces[name] = _interface;
+			StateData * stateData = getStateData();
+			stateData->interfaces[name] = _interface;
 			_interface->getConstructor();
 		}
 		
 		template<class C> C * getInterface(const std::string & name){
-			StateData * localStateData = getLocalStateData();
-			C * iface = dynamic_cast<C*>(localStateData->interfaces[name]);
+			StateData * stateData = getStateData();
+			C * iface = dynamic_cast<C*>(stateData->interfaces[name]);
 			assert(iface);
 			return iface;
 		}
 
+		/*
+			Returns the last interface registered with registerInterface<C>, no string lookups involved
+		*/
+		template<class C> C * getInterface(){
+			StateData * stateData = getStateData();
+			const size_t index = InterfaceIndex::get<C>();
+			if (index < stateData->typedInterfaces.size()){
+				return static_cast<C *>(stateData->typedInterfaces[index]);
+			}
+			return nullptr;
+		}
+
 		/*
 			Misc
 		*/
@@ -241,13 +399,24 @@ namespace lutok2 {
 			return debugInfo;
 		}
 
-		const std::string traceback() {
+		/*
+			Captures current call stack, the text is formatted only when it's read (Traceback::str)
+		*/
+		Traceback captureTraceback(const int level = 0, const int maxDepth = Traceback::defaultDepth){
+			return Traceback::capture(state, level, maxDepth);
+		}
+
+		const std::string traceback(const int maxDepth = Traceback::defaultDepth) {
 			lua_Debug info;
 			int level = 0;
 			std::string outputTraceback;
 			char buffer[4096];
 
 			while (lua_getstack(state, level, &info)) {
+				if (level >= maxDepth){
+					outputTraceback.append("  ...\n");
+					break;
+				}
 				lua_getinfo(state, "nSl", &info);
 
 #if defined(_WIN32) && defined(_MSC_VER)
@@ -255,7 +424,7 @@ namespace lutok2 {
 					level, info.short_src, info.currentline,
 					(info.name ? info.name : "<unknown>"), info.what);
 #else
-				sprintf(buffer, "  [%d] %s:%d -- %s [%s]\n",
+				snprintf(buffer, sizeof(buffer), "  [%d] %s:%d -- %s [%s]\n",
 					level, info.short_src, info.currentline,
 					(info.name ? info.name : "<unknown>"), info.what);
 #endif
@@ -0,0 +1,201 @@
+#ifndef LUTOK2_STATEPOOL_H
+#define LUTOK2_STATEPOOL_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+
+namespace lutok2 {
+	/*
+		Pool of pre-initialized Lua states
+
+		Every state is initialized once (libraries, interfaces, scripts) by initializer function.
+		Threads check states out with RAII leases. Checkout scans slot flags with atomic operations starting
+		at a thread specific slot, so threads don't share a lock unless the whole pool is busy.
+		Released state gets its stack cleared and selected global variables restored to values they had after initialization.
+	*/
+	class StatePool {
+	public:
+		typedef std::function<void(State &)> Initializer;
+
+		class Lease {
+		friend class StatePool;
+		private:
+			StatePool * pool;
+			size_t slot;
+
+			Lease(StatePool * pool, const size_t slot){
+				this->pool = pool;
+				this->slot = slot;
+			}
+			Lease(const Lease &);
+			Lease & operator= (const Lease &);
+		public:
+			Lease(){
+				pool = nullptr;
+				slot = 0;
+			}
+			Lease(Lease && lease){
+				pool = lease.pool;
+				slot = lease.slot;
+				lease.pool = nullptr;
+			}
+			Lease & operator= (Lease && lease){
+				if (this != &lease){
+					release();
+					pool = lease.pool;
+					slot = lease.slot;
+					lease.pool = nullptr;
+				}
+				return *this;
+			}
+			~Lease(){
+				release();
+			}
+
+			void release(){
+				if (pool != nullptr){
+					pool->release(slot);
+					pool = nullptr;
+				}
+			}
+
+			inline explicit operator bool() const {
+				return pool != nullptr;
+			}
+			inline State & operator* () const {
+				return *pool->slots[slot].state;
+			}
+			inline State * operator-> () const {
+				return pool->slots[slot].state.get();
+			}
+		};
+
+	private:
+		struct Slot {
+			std::unique_ptr<State> state;
+			std::vector<int> globalRefs;
+			std::atomic<bool> busy;
+			// keeps busy flags of neighbouring slots in different cache lines
+			char padding[64];
+		};
+
+		std::unique_ptr<Slot[]> slots;
+		size_t size;
+		std::vector<std::string> resetGlobals;
+
+		std::mutex waitMutex;
+		std::condition_variable available;
+		std::atomic<size_t> waiters;
+
+		/*
+			Thread id hash is often the page aligned pthread_t, its low bits are the same for all threads.
+			Multiply-shift mixing moves the varying high bits into the slot number.
+		*/
+		size_t startSlot() const {
+			const uint64_t value = static_cast<uint64_t>(std::hash<std::thread::id>()(std::this_thread::get_id()));
+			return static_cast<size_t>((value * 0x9E3779B97F4A7C15ULL) >> 32) % size;
+		}
+
+		bool tryLock(size_t & slot){
+			const size_t start = startSlot();
+			for (size_t i = 0; i < size; i++){
+				const size_t index = (start + i) % size;
+				bool expected = false;
+				if (!slots[index].busy.load(std::memory_order_relaxed) && slots[index].busy.compare_exchange_strong(expected, true)){
+					slot = index;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void reset(Slot & slot){
+			State & state = *slot.state;
+			state.stack->setTop(0);
+			for (size_t i = 0; i < resetGlobals.size(); i++){
+				state.stack->regValue(slot.globalRefs[i]);
+				state.stack->setGlobal(resetGlobals[i]);
+			}
+		}
+
+		void release(const size_t index){
+			reset(slots[index]);
+			slots[index].busy.store(false);
+			if (waiters.load() > 0){
+				std::lock_guard<std::mutex> lock(waitMutex);
+				available.notify_one();
+			}
+		}
+
+		StatePool(const StatePool &);
+		StatePool & operator= (const StatePool &);
+	public:
+		/*
+			size - number of states, at least one
+			initializer - prepares each state (e.g. openLibs, registerInterface, loadFile)
+			resetGlobals - global variables restored on every release
+		*/
+		StatePool(const size_t size, const Initializer & initializer, const std::vector<std::string> & resetGlobals = std::vector<std::string>())
+			: slots(new Slot[size]), waiters(0){
+			if (size == 0){
+				throw std::invalid_argument("State pool must have at least one state");
+			}
+			this->size = size;
+			this->resetGlobals = resetGlobals;
+
+			// states are owned by slots, so the ones created before a failing initializer are freed too
+			for (size_t i = 0; i < size; i++){
+				Slot & slot = slots[i];
+				slot.state.reset(new State());
+				slot.busy.store(false);
+				initializer(*slot.state);
+				slot.state->stack->setTop(0);
+				for (std::vector<std::string>::const_iterator iter = resetGlobals.begin(); iter != resetGlobals.end(); iter++){
+					slot.state->stack->getGlobal(*iter);
+					slot.globalRefs.push_back(slot.state->stack->ref());
+				}
+			}
+		}
+
+		// all leases must be released before the pool is destroyed
+		~StatePool(){
+		}
+
+		/*
+			Returns a lease of free state, blocks while all states are in use.
+		*/
+		Lease acquire(){
+			size_t slot = 0;
+			if (tryLock(slot)){
+				return Lease(this, slot);
+			}
+			std::unique_lock<std::mutex> lock(waitMutex);
+			waiters++;
+			available.wait(lock, [&]() -> bool {
+				return tryLock(slot);
+			});
+			waiters--;
+			return Lease(this, slot);
+		}
+
+		/*
+			Returns an empty lease if there's no free state.
+		*/
+		Lease tryAcquire(){
+			size_t slot = 0;
+			if (tryLock(slot)){
+				return Lease(this, slot);
+			}
+			return Lease();
+		}
+
+		inline size_t getSize() const {
+			return size;
+		}
+	};
+};
+
+#endif
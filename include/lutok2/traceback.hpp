@@ -0,0 +1,156 @@
+#ifndef LUTOK2_TRACEBACK_H
+#define LUTOK2_TRACEBACK_H
+
+namespace lutok2 {
+	/*
+		Lazily formatted stack traceback
+
+		Capture only records called functions and current lines of at most maxDepth frames into a Lua table
+		(no function name lookup, no string formatting). Text is produced on the first str() call.
+		Traceback must not outlive its Lua state.
+	*/
+	class Traceback {
+	private:
+		lua_State * state;
+		int framesRef;
+		int depth;
+		bool truncated;
+		mutable std::string text;
+
+		Traceback(const Traceback &);
+		Traceback & operator= (const Traceback &);
+
+		void release(){
+			if (state != nullptr && framesRef != LUA_NOREF){
+				luaL_unref(state, LUA_REGISTRYINDEX, framesRef);
+			}
+			framesRef = LUA_NOREF;
+		}
+	public:
+		static const int defaultDepth = 32;
+
+		Traceback() : state(nullptr), framesRef(LUA_NOREF), depth(0), truncated(false){
+		}
+
+		Traceback(Traceback && traceback) : state(traceback.state), framesRef(traceback.framesRef),
+			depth(traceback.depth), truncated(traceback.truncated), text(std::move(traceback.text)){
+			traceback.framesRef = LUA_NOREF;
+			traceback.depth = 0;
+		}
+
+		Traceback & operator= (Traceback && traceback){
+			if (this != &traceback){
+				release();
+				state = traceback.state;
+				framesRef = traceback.framesRef;
+				depth = traceback.depth;
+				truncated = traceback.truncated;
+				text = std::move(traceback.text);
+				traceback.framesRef = LUA_NOREF;
+				traceback.depth = 0;
+			}
+			return *this;
+		}
+
+		~Traceback(){
+			release();
+		}
+
+		/*
+			Pushes a table of captured frames (function and current line pairs) starting at level,
+			returns the number of captured frames. The last item is true if frames were left out.
+		*/
+		static int pushFrames(lua_State * L, const int level, const int maxDepth){
+			lua_Debug info;
+			int count = 0;
+			lua_createtable(L, 2 * maxDepth + 1, 0);
+			for (int current = level; lua_getstack(L, current, &info) != 0; current++){
+				if (count >= maxDepth){
+					lua_pushboolean(L, 1);
+					lua_rawseti(L, -2, 2 * count + 1);
+					break;
+				}
+				lua_getinfo(L, "fl", &info);
+				lua_rawseti(L, -2, 2 * count + 1);
+				lua_pushinteger(L, info.currentline);
+				lua_rawseti(L, -2, 2 * count + 2);
+				count++;
+			}
+			return count;
+		}
+
+		/*
+			Takes a table created by pushFrames from the top of the stack
+		*/
+		static Traceback fromFrames(lua_State * L){
+			Traceback traceback;
+			if (lua_type(L, -1) == LUA_TTABLE){
+				traceback.state = L;
+				traceback.depth = static_cast<int>(lua_objlen(L, -1) / 2);
+				lua_rawgeti(L, -1, 2 * traceback.depth + 1);
+				traceback.truncated = lua_toboolean(L, -1) != 0;
+				lua_pop(L, 1);
+				traceback.framesRef = luaL_ref(L, LUA_REGISTRYINDEX);
+			}else{
+				lua_pop(L, 1);
+			}
+			return traceback;
+		}
+
+		/*
+			Captures frames of the current call stack, level 0 is the running function
+		*/
+		static Traceback capture(lua_State * L, const int level = 0, const int maxDepth = defaultDepth){
+			pushFrames(L, level, maxDepth);
+			return fromFrames(L);
+		}
+
+		inline bool empty() const {
+			return depth == 0 && text.empty();
+		}
+
+		inline int getDepth() const {
+			return depth;
+		}
+
+		/*
+			Formats the traceback on first use, captured frames are released afterwards
+		*/
+		const std::string & str(){
+			if (framesRef == LUA_NOREF){
+				return text;
+			}
+			text = "stack traceback:";
+			lua_rawgeti(state, LUA_REGISTRYINDEX, framesRef);
+			for (int i = 0; i < depth; i++){
+				lua_Debug info;
+				lua_rawgeti(state, -1, 2 * i + 2);
+				const int currentLine = static_cast<int>(lua_tointeger(state, -1));
+				lua_pop(state, 1);
+				lua_rawgeti(state, -1, 2 * i + 1);
+				lua_getinfo(state, ">S", &info);
+
+				text += "\n\t";
+				text += info.short_src;
+				if (currentLine > 0){
+					text += ":" + std::to_string(static_cast<long long>(currentLine));
+				}
+				if (*info.what == 'm'){
+					text += ": in main chunk";
+				}else if (*info.what == 'C'){
+					text += ": in C function";
+				}else{
+					text += ": in function <" + std::string(info.short_src) + ":" + std::to_string(static_cast<long long>(info.linedefined)) + ">";
+				}
+			}
+			if (truncated){
+				text += "\n\t...";
+			}
+			lua_pop(state, 1);
+			release();
+			return text;
+		}
+	};
+};
+
+#endif
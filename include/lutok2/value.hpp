@@ -0,0 +1,277 @@
+#ifndef LUTOK2_VALUE_H
+#define LUTOK2_VALUE_H
+
+#include <map>
+
+namespace lutok2 {
+	/*
+		Direct conversion between C++ values and Lua stack slots.
+		Used by typed bindings so the generated lua_CFunction calls Lua API without any indirection.
+	*/
+
+	template<typename T, typename Enable = void> struct StackValue;
+
+	template<> struct StackValue<bool> {
+		static inline bool get(lua_State * L, const int index){
+			return lua_toboolean(L, index) != 0;
+		}
+		static inline void push(lua_State * L, const bool value){
+			lua_pushboolean(L, value);
+		}
+	};
+
+	template<typename T> struct StackValue<T, typename std::enable_if<std::is_integral<T>::value>::type> {
+		static inline T get(lua_State * L, const int index){
+			return static_cast<T>(lua_tointeger(L, index));
+		}
+		static inline void push(lua_State * L, const T value){
+			lua_pushinteger(L, static_cast<lua_Integer>(value));
+		}
+	};
+
+	template<typename T> struct StackValue<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+		static inline T get(lua_State * L, const int index){
+			return static_cast<T>(lua_tonumber(L, index));
+		}
+		static inline void push(lua_State * L, const T value){
+			lua_pushnumber(L, static_cast<lua_Number>(value));
+		}
+	};
+
+	template<> struct StackValue<const char *> {
+		static inline const char * get(lua_State * L, const int index){
+			return lua_tostring(L, index);
+		}
+		static inline void push(lua_State * L, const char * value){
+			lua_pushstring(L, value);
+		}
+	};
+
+	template<> struct StackValue<std::string> {
+		static inline std::string get(lua_State * L, const int index){
+			size_t len = 0;
+			const char * value = lua_tolstring(L, index, &len);
+			return (value != nullptr) ? std::string(value, len) : std::string();
+		}
+		static inline void push(lua_State * L, const std::string & value){
+			lua_pushlstring(L, value.c_str(), value.length());
+		}
+	};
+
+	/*
+		Non-owning reference to string data (pointer and length)
+
+		References obtained from Lua stack point into the Lua string itself and remain valid
+		only while the string value stays on the stack (or is otherwise referenced from Lua).
+	*/
+	class StringRef {
+	private:
+		const char * pointer;
+		size_t size;
+	public:
+		StringRef() : pointer(nullptr), size(0){
+		}
+		StringRef(const char * data, const size_t length) : pointer(data), size(length){
+		}
+		StringRef(const char * data) : pointer(data), size((data != nullptr) ? strlen(data) : 0){
+		}
+		StringRef(const std::string & value) : pointer(value.data()), size(value.length()){
+		}
+#if __cplusplus >= 201703L
+		StringRef(const std::string_view value) : pointer(value.data()), size(value.length()){
+		}
+		inline operator std::string_view() const {
+			return std::string_view(pointer, size);
+		}
+#endif
+
+		inline const char * data() const {
+			return pointer;
+		}
+		inline size_t length() const {
+			return size;
+		}
+		inline bool empty() const {
+			return size == 0;
+		}
+		inline std::string str() const {
+			return (pointer != nullptr) ? std::string(pointer, size) : std::string();
+		}
+
+		inline bool operator== (const StringRef & other) const {
+			return size == other.size && (size == 0 || memcmp(pointer, other.pointer, size) == 0);
+		}
+		inline bool operator!= (const StringRef & other) const {
+			return !(*this == other);
+		}
+	};
+
+	// numbers are converted into strings in place, like lua_tolstring does
+	template<> struct StackValue<StringRef> {
+		static inline StringRef get(lua_State * L, const int index){
+			size_t len = 0;
+			const char * value = lua_tolstring(L, index, &len);
+			return StringRef(value, len);
+		}
+		static inline void push(lua_State * L, const StringRef & value){
+			lua_pushlstring(L, value.data(), value.length());
+		}
+	};
+
+#if __cplusplus >= 201703L
+	template<> struct StackValue<std::string_view> {
+		static inline std::string_view get(lua_State * L, const int index){
+			size_t len = 0;
+			const char * value = lua_tolstring(L, index, &len);
+			return (value != nullptr) ? std::string_view(value, len) : std::string_view();
+		}
+		static inline void push(lua_State * L, const std::string_view value){
+			lua_pushlstring(L, value.data(), value.length());
+		}
+	};
+#endif
+
+	template<> struct StackValue<void *> {
+		static inline void * get(lua_State * L, const int index){
+			return lua_touserdata(L, index);
+		}
+		static inline void push(lua_State * L, void * value){
+			lua_pushlightuserdata(L, value);
+		}
+	};
+
+	/*
+		Containers are converted to Lua tables and back in a single call.
+		Tables are presized and filled with raw access, so no metamethods are involved.
+		Sequences map to arrays (1-based), maps to hash tables, pairs and tuples to arrays of their elements.
+	*/
+
+	static inline int absoluteIndex(lua_State * L, const int index){
+		return (index < 0 && index > LUA_REGISTRYINDEX) ? (lua_gettop(L) + index + 1) : index;
+	}
+
+	template<typename T> struct StackValue< std::vector<T> > {
+		static std::vector<T> get(lua_State * L, int index){
+			std::vector<T> result;
+			if (lua_type(L, index) == LUA_TTABLE){
+				index = absoluteIndex(L, index);
+				const int length = static_cast<int>(lua_objlen(L, index));
+				result.reserve(length);
+				for (int i = 1; i <= length; i++){
+					lua_rawgeti(L, index, i);
+					result.push_back(StackValue<T>::get(L, -1));
+					lua_pop(L, 1);
+				}
+			}
+			return result;
+		}
+		static void push(lua_State * L, const std::vector<T> & value){
+			const int length = static_cast<int>(value.size());
+			lua_createtable(L, length, 0);
+			for (int i = 0; i < length; i++){
+				StackValue<T>::push(L, value[i]);
+				lua_rawseti(L, -2, i + 1);
+			}
+		}
+	};
+
+	template<typename M> struct StackMapValue {
+		typedef typename M::key_type K;
+		typedef typename M::mapped_type V;
+
+		static M get(lua_State * L, int index){
+			M result;
+			if (lua_type(L, index) == LUA_TTABLE){
+				index = absoluteIndex(L, index);
+				lua_pushnil(L);
+				while (lua_next(L, index) != 0){
+					//key copy - lua_tolstring would change the original key and break lua_next
+					lua_pushvalue(L, -2);
+					result[StackValue<K>::get(L, -1)] = StackValue<V>::get(L, -2);
+					lua_pop(L, 2);
+				}
+			}
+			return result;
+		}
+		static void push(lua_State * L, const M & value){
+			lua_createtable(L, 0, static_cast<int>(value.size()));
+			for (typename M::const_iterator iter = value.begin(); iter != value.end(); iter++){
+				StackValue<K>::push(L, iter->first);
+				StackValue<V>::push(L, iter->second);
+				lua_rawset(L, -3);
+			}
+		}
+	};
+
+	template<typename K, typename V> struct StackValue< std::map<K, V> > : public StackMapValue< std::map<K, V> > {
+	};
+
+	template<typename K, typename V> struct StackValue< std::unordered_map<K, V> > : public StackMapValue< std::unordered_map<K, V> > {
+	};
+
+	template<typename A, typename B> struct StackValue< std::pair<A, B> > {
+		static std::pair<A, B> get(lua_State * L, int index){
+			std::pair<A, B> result;
+			if (lua_type(L, index) == LUA_TTABLE){
+				index = absoluteIndex(L, index);
+				lua_rawgeti(L, index, 1);
+				lua_rawgeti(L, index, 2);
+				result.first = StackValue<A>::get(L, -2);
+				result.second = StackValue<B>::get(L, -1);
+				lua_pop(L, 2);
+			}
+			return result;
+		}
+		static void push(lua_State * L, const std::pair<A, B> & value){
+			lua_createtable(L, 2, 0);
+			StackValue<A>::push(L, value.first);
+			lua_rawseti(L, -2, 1);
+			StackValue<B>::push(L, value.second);
+			lua_rawseti(L, -2, 2);
+		}
+	};
+
+	template<size_t I, size_t N> struct TupleElements {
+		template<typename T> static inline void get(lua_State * L, const int index, T & value){
+			typedef typename std::tuple_element<I, T>::type E;
+			lua_rawgeti(L, index, static_cast<int>(I + 1));
+			std::get<I>(value) = StackValue<E>::get(L, -1);
+			lua_pop(L, 1);
+			TupleElements<I + 1, N>::get(L, index, value);
+		}
+		template<typename T> static inline void push(lua_State * L, const T & value){
+			typedef typename std::tuple_element<I, T>::type E;
+			StackValue<E>::push(L, std::get<I>(value));
+			lua_rawseti(L, -2, static_cast<int>(I + 1));
+			TupleElements<I + 1, N>::push(L, value);
+		}
+	};
+
+	template<size_t N> struct TupleElements<N, N> {
+		template<typename T> static inline void get(lua_State * L, const int index, T & value){
+			LUTOK2_NOT_USED(L);
+			LUTOK2_NOT_USED(index);
+			LUTOK2_NOT_USED(value);
+		}
+		template<typename T> static inline void push(lua_State * L, const T & value){
+			LUTOK2_NOT_USED(L);
+			LUTOK2_NOT_USED(value);
+		}
+	};
+
+	template<typename... Args> struct StackValue< std::tuple<Args...> > {
+		static std::tuple<Args...> get(lua_State * L, int index){
+			std::tuple<Args...> result;
+			if (lua_type(L, index) == LUA_TTABLE){
+				TupleElements<0, sizeof...(Args)>::get(L, absoluteIndex(L, index), result);
+			}
+			return result;
+		}
+		static void push(lua_State * L, const std::tuple<Args...> & value){
+			lua_createtable(L, static_cast<int>(sizeof...(Args)), 0);
+			TupleElements<0, sizeof...(Args)>::push(L, value);
+		}
+	};
+};
+
+#endif
@@ -0,0 +1,858 @@
+#include "lutok2/lutok2.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+#include <fstream>
+#include <thread>
+#include <map>
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+using namespace lutok2;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static double elapsedNs(const Clock::time_point & start, const Clock::time_point & end){
+	return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+}
+
+/*
+	Every benchmark is run once to warm up and then repeatedly, report() collects ns/op of each run
+	and the summary prints percentiles over the runs. Diagnostic output is printed on the last run only.
+*/
+static bool recording = false;
+static bool verbose = false;
+static std::vector<std::string> resultNames;
+static std::map<std::string, std::vector<double>> results;
+
+static void report(const char * name, const double ns, const int iterations){
+	if (!recording){
+		return;
+	}
+	std::vector<double> & samples = results[name];
+	if (samples.empty()){
+		resultNames.push_back(name);
+	}
+	samples.push_back(ns / iterations);
+}
+
+// nearest-rank percentile of sorted samples
+static double percentile(const std::vector<double> & sorted, const double p){
+	size_t rank = static_cast<size_t>(p / 100.0 * sorted.size() + 0.999999);
+	rank = std::min(std::max<size_t>(rank, 1), sorted.size());
+	return sorted[rank - 1];
+}
+
+static void printResults(){
+	printf("%-40s %12s %12s %12s %12s %14s\n", "benchmark (ns/op)", "min", "median", "p90", "p99", "median ops/s");
+	for (std::vector<std::string>::const_iterator iter = resultNames.begin(); iter != resultNames.end(); iter++){
+		std::vector<double> sorted = results[*iter];
+		std::sort(sorted.begin(), sorted.end());
+		const double median = percentile(sorted, 50.0);
+		printf("%-40s %12.2f %12.2f %12.2f %12.2f %14.0f\n", iter->c_str(),
+			sorted.front(), median, percentile(sorted, 90.0), percentile(sorted, 99.0), 1e9 / median);
+	}
+}
+
+static size_t residentSetSize(){
+#if defined(__linux__)
+	long pages = 0, resident = 0;
+	FILE * f = fopen("/proc/self/statm", "r");
+	if (f != nullptr){
+		if (fscanf(f, "%ld %ld", &pages, &resident) != 2){
+			resident = 0;
+		}
+		fclose(f);
+	}
+	return static_cast<size_t>(resident) * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+	return 0;
+#endif
+}
+
+/*
+	Runs a script with iteration count as its argument and returns elapsed time in nanoseconds.
+*/
+static double runScript(State & state, const char * script, const int iterations){
+	state.loadString(script);
+	state.stack->push<int>(iterations);
+	Clock::time_point start = Clock::now();
+	state.stack->call(1, 0);
+	return elapsedNs(start, Clock::now());
+}
+
+static double runCallLoop(State & state, const int iterations){
+	return runScript(state, "local f, n = f, ...; for i = 1, n do f(i) end", iterations);
+}
+
+/*
+	Replica of the previous cxx_function_wrapper dispatch (heap allocated Stack, debug info query
+	and upvalue push/type/pop) kept here as a reference point.
+*/
+static int legacy_function_wrapper(lua_State * L){
+	State state(L, false);
+	Stack * stack = new Stack(&state.state, &state.originalState, &state);
+	const lua_Debug info = state.getInfo("nSlu");
+	int result = 0;
+
+	if (info.nups >= 1){
+		stack->pushValue(stack->upvalueIndex(1));
+		if (stack->type(-1) == LUA_TUSERDATA){
+			Function ** originalFunction = reinterpret_cast<Function **>(stack->to<void*>(-1));
+			stack->pop(1);
+			result = (**originalFunction)(state);
+		}
+	}
+	delete stack;
+	return result;
+}
+
+static int rawFunction(lua_State * L){
+	lua_pushinteger(L, lua_tointeger(L, 1) + 1);
+	return 1;
+}
+
+static int cxxFunction(State & state){
+	state.stack->push<int>(state.stack->to<int>(1) + 1);
+	return 1;
+}
+
+static uint32_t hashBytes(const char * data, const size_t length){
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++){
+		hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+	}
+	return hash;
+}
+
+static int hashStringCopy(State & state){
+	const std::string value = state.stack->toLString(1);
+	state.stack->push<int>(static_cast<int>(hashBytes(value.c_str(), value.length()) & 0xffff));
+	return 1;
+}
+
+static int hashStringRef(State & state){
+	const StringRef value = state.stack->toStringRef(1);
+	state.stack->push<int>(static_cast<int>(hashBytes(value.data(), value.length()) & 0xffff));
+	return 1;
+}
+
+/*
+	Hashing of string arguments - copy into std::string vs StringRef
+*/
+static void benchmarkStringArguments(const int iterations){
+	State state;
+	state.openLibs();
+	const char * script = "local n, f, s = ..., f, string.rep('x', 200); for i = 1, n do f(s) end";
+
+	state.stack->push<cxx_function>(hashStringCopy);
+	state.stack->setGlobal("f");
+	report("string argument (std::string copy)", runScript(state, script, iterations), iterations);
+
+	state.stack->push<cxx_function>(hashStringRef);
+	state.stack->setGlobal("f");
+	report("string argument (StringRef)", runScript(state, script, iterations), iterations);
+}
+
+static void benchmarkFunctionCalls(const int iterations){
+	State state;
+	state.openLibs();
+
+	state.stack->push<lua_CFunction>(rawFunction);
+	state.stack->setGlobal("f");
+	report("call lua_CFunction", runCallLoop(state, iterations), iterations);
+
+	state.stack->push<cxx_function>(cxxFunction);
+	state.stack->setGlobal("f");
+	report("call cxx_function (wrapper)", runCallLoop(state, iterations), iterations);
+
+	state.stack->push<Function>([](State & state) -> int {
+		state.stack->push<int>(state.stack->to<int>(1) + 1);
+		return 1;
+	});
+	state.stack->setGlobal("f");
+	report("call Function (std::function)", runCallLoop(state, iterations), iterations);
+
+	Function ** wrappedFunction = static_cast<Function **>(state.stack->newUserData(sizeof(Function*)));
+	*wrappedFunction = new Function(cxxFunction);
+	state.stack->pushClosure(legacy_function_wrapper, 1);
+	state.stack->setGlobal("f");
+	report("call cxx_function (legacy wrapper)", runCallLoop(state, iterations), iterations);
+}
+
+class BenchObj {
+public:
+	int counter;
+	BenchObj() : counter(0){
+	}
+};
+
+class LBenchObj : public Object<BenchObj> {
+public:
+	explicit LBenchObj(State * state) : Object<BenchObj>(state){
+		LUTOK_METHOD("inc", &LBenchObj::inc);
+		LUTOK_PROPERTY("legacyInc", &LBenchObj::legacyInc, &LBenchObj::nullMethod);
+		LUTOK_PROPERTY("value", &LBenchObj::getValue, &LBenchObj::setValue);
+	}
+	BenchObj * constructor(State & state, bool & managed){
+		managed = true;
+		return new BenchObj;
+	}
+	void destructor(State & state, BenchObj * object){
+		delete object;
+	}
+	int inc(State & state, BenchObj * object){
+		object->counter++;
+		return 0;
+	}
+	int getValue(State & state, BenchObj * object){
+		state.stack->push<int>(object->counter);
+		return 1;
+	}
+	int setValue(State & state, BenchObj * object){
+		object->counter = state.stack->to<int>(1);
+		return 0;
+	}
+	// previous Object::index behaviour - a new closure for every method lookup
+	int legacyInc(State & state, BenchObj * object){
+		state.stack->push<Function>([=](State & state) -> int {
+			object->counter++;
+			return 0;
+		});
+		return 1;
+	}
+};
+
+static void benchmarkMethodCalls(const int iterations){
+	State state;
+	state.openLibs();
+	state.registerInterface<LBenchObj>("benchObj");
+	state.stack->setGlobal("benchObj");
+
+	report("method call (cached closure)", runScript(state, "local o, n = benchObj(), ...; for i = 1, n do o:inc() end", iterations), iterations);
+	report("method call (closure per lookup)", runScript(state, "local o, n = benchObj(), ...; for i = 1, n do o.legacyInc() end", iterations), iterations);
+	report("property get", runScript(state, "local o, n = benchObj(), ...; local v; for i = 1, n do v = o.value end", iterations), iterations);
+	report("property set", runScript(state, "local o, n = benchObj(), ...; for i = 1, n do o.value = i end", iterations), iterations);
+
+	// constructor calls with collection of the created objects included
+	const int objects = std::max(1, iterations / 10);
+	report("object construction and GC", runScript(state, "local n, benchObj = ..., benchObj; for i = 1, n do local o = benchObj() end; collectgarbage()", objects), objects);
+}
+
+/*
+	Pushes closures with captured state in rounds, resident memory should stay flat as
+	released closures destroy their Function objects.
+*/
+static void soakFunctionPush(const int iterations){
+	State state;
+	const std::string captured(256, 'x');
+
+	for (int round = 1; round <= 10; round++){
+		for (int i = 0; i < iterations; i++){
+			state.stack->push<Function>([captured](State & state) -> int {
+				state.stack->push<const std::string &>(captured);
+				return 1;
+			});
+			state.stack->pop(1);
+		}
+		lua_gc(state.state, LUA_GCCOLLECT, 0);
+		printf("function push soak round %2d: %10d pushes, Lua heap %8d KB, RSS %8zu KB\n",
+			round, round * iterations, lua_gc(state.state, LUA_GCCOUNT, 0), residentSetSize() / 1024);
+	}
+}
+
+static const char * gcWorkload = "local n = ...; local keep = {}; for i = 1, n do local t = {i, tostring(i), function() return i end}; keep[i % 1024] = t end";
+
+static void benchmarkAllocators(const int iterations){
+	{
+		State state;
+		state.openLibs();
+		report("GC workload (default allocator)", runScript(state, gcWorkload, iterations), iterations);
+	}
+	{
+		PoolAllocator allocator;
+		State state(PoolAllocator::alloc, &allocator);
+		state.openLibs();
+		report("GC workload (pool allocator)", runScript(state, gcWorkload, iterations), iterations);
+
+		const PoolAllocator::Stats & stats = allocator.getStats();
+		if (!verbose){
+			return;
+		}
+		printf("pool allocator: live %zu KB, peak %zu KB, reserved %zu KB, large blocks %zu\n",
+			stats.live / 1024, stats.peak / 1024, stats.reserved / 1024, stats.allocations[PoolAllocator::classCount]);
+		for (size_t i = 0; i < PoolAllocator::classCount; i++){
+			if (stats.allocations[i] > 0){
+				printf("  %4zu B: %zu allocations\n", (i + 1) * PoolAllocator::granularity, stats.allocations[i]);
+			}
+		}
+	}
+}
+
+/*
+	State warm-up (open libraries and load a tree of generated scripts) with and without chunk cache
+*/
+static void benchmarkChunkCache(const int fileCount){
+	std::vector<std::string> fileNames;
+	for (int i = 0; i < fileCount; i++){
+		const std::string fileName = "lutok2_bench_" + std::to_string(i) + ".lua";
+		std::ofstream file(fileName.c_str());
+		file << "local M = {}\n";
+		for (int j = 0; j < 500; j++){
+			file << "function M.f" << j << "(a, b) local t = {a, b, " << j << "} if a > b then return t[1] * " << j << " else return t[2] + t[3] end end\n";
+		}
+		file << "return M\n";
+		fileNames.push_back(fileName);
+	}
+
+	std::function<void(ChunkCache *)> warmUp = [&](ChunkCache * cache){
+		State state;
+		state.openLibs();
+		for (std::vector<std::string>::iterator iter = fileNames.begin(); iter != fileNames.end(); iter++){
+			if (cache != nullptr){
+				cache->loadFile(state, *iter);
+			}else{
+				state.loadFile(*iter);
+			}
+			state.stack->call(0, 0);
+		}
+	};
+
+	const int rounds = 10;
+	ChunkCache cache;
+	warmUp(&cache);
+
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < rounds; i++){
+		warmUp(nullptr);
+	}
+	report("state warm-up (source)", elapsedNs(start, Clock::now()), rounds);
+
+	start = Clock::now();
+	for (int i = 0; i < rounds; i++){
+		warmUp(&cache);
+	}
+	report("state warm-up (chunk cache)", elapsedNs(start, Clock::now()), rounds);
+
+	for (std::vector<std::string>::iterator iter = fileNames.begin(); iter != fileNames.end(); iter++){
+		std::remove(iter->c_str());
+	}
+}
+
+/*
+	Compilation of a large generated data script - memory mapped loader vs luaL_loadfile
+*/
+static void benchmarkFileLoading(){
+	const char * fileName = "lutok2_bench_data.lua";
+	{
+		std::ofstream file(fileName);
+		file << "return {\n";
+		for (int i = 0; i < 100000; i++){
+			file << "\t{id = " << i << ", name = \"item" << i << "\", values = {" << i * 0.5 << ", " << i * 2 << ", " << i * 3 << "}},\n";
+		}
+		file << "}\n";
+	}
+
+	const int rounds = 10;
+	State state;
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < rounds; i++){
+		luaL_loadfile(state.state, fileName);
+		state.stack->pop(1);
+	}
+	report("load data script (luaL_loadfile)", elapsedNs(start, Clock::now()), rounds);
+
+	start = Clock::now();
+	for (int i = 0; i < rounds; i++){
+		state.loadFile(fileName);
+		state.stack->pop(1);
+	}
+	report("load data script (mapped file)", elapsedNs(start, Clock::now()), rounds);
+
+	std::string source = "local M = {}\n";
+	for (int i = 0; i < 1000; i++){
+		source += "function M.f" + std::to_string(i) + "(a, b) if a > b then return a * " + std::to_string(i) + " else return b - a end end\n";
+	}
+	source += "return M\n";
+	start = Clock::now();
+	for (int i = 0; i < rounds * 10; i++){
+		state.loadString(source);
+		state.stack->pop(1);
+	}
+	report("compile module (loadString)", elapsedNs(start, Clock::now()), rounds * 10);
+
+	std::remove(fileName);
+}
+
+/*
+	Worker threads checking out pooled states and running a short request script
+*/
+static void benchmarkStatePool(const int iterations){
+	const size_t threadCount = std::max<size_t>(2, std::thread::hardware_concurrency());
+	StatePool pool(threadCount, [](State & state){
+		state.openLibs();
+		state.loadString("function handle(n) local t = {} for i = 1, n do t[i] = i end return #t end");
+		state.stack->call(0, 0);
+	}, {"handle"});
+
+	const int requests = iterations / 10;
+	std::vector<std::thread> threads;
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < threadCount; i++){
+		threads.push_back(std::thread([&pool, requests](){
+			for (int j = 0; j < requests; j++){
+				StatePool::Lease lease = pool.acquire();
+				lease->stack->getGlobal("handle");
+				lease->stack->push<int>(16);
+				lease->stack->call(1, 1);
+			}
+		}));
+	}
+	for (std::vector<std::thread>::iterator iter = threads.begin(); iter != threads.end(); iter++){
+		iter->join();
+	}
+	report("state pool request", elapsedNs(start, Clock::now()), static_cast<int>(requests * threadCount));
+}
+
+/*
+	Objects pushed from C++ and dropped right away - cached metatable reference vs previous
+	metatable lookup by type name on every push
+*/
+static void benchmarkObjectPush(const int iterations){
+	State state;
+	state.registerInterface<LBenchObj>("benchObj");
+	state.stack->pop(1);
+	LBenchObj * iface = state.getInterface<LBenchObj>();
+	BenchObj object;
+
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < iterations; i++){
+		iface->push(&object, false);
+		state.stack->pop(1);
+	}
+	report("object push (cached metatable)", elapsedNs(start, Clock::now()), iterations);
+
+	start = Clock::now();
+	for (int i = 0; i < iterations; i++){
+		State view(state.state, false);
+		typedef Object<BenchObj>::ObjWrapper ObjWrapper;
+		ObjWrapper * wrapper = static_cast<ObjWrapper *>(view.stack->newUserData(sizeof(ObjWrapper)));
+		wrapper->instance = &object;
+		wrapper->owned = false;
+		wrapper->inlined = false;
+		view.stack->newMetatable(typeid(BenchObj).name());
+		view.stack->setMetatable();
+		state.stack->pop(1);
+	}
+	report("object push (metatable name lookup)", elapsedNs(start, Clock::now()), iterations);
+	lua_gc(state.state, LUA_GCCOLLECT, 0);
+}
+
+/*
+	Numeric array handoff - element by element push/rawSet vs container conversion
+*/
+static void benchmarkContainers(const int iterations){
+	State state;
+	const int length = 1000;
+	const int rounds = std::max(1, iterations / length);
+	std::vector<double> values(length);
+	for (int i = 0; i < length; i++){
+		values[i] = i * 0.5;
+	}
+
+	Clock::time_point start = Clock::now();
+	for (int round = 0; round < rounds; round++){
+		state.stack->newTable();
+		for (int i = 0; i < length; i++){
+			state.stack->push<int>(i + 1);
+			state.stack->push<LUA_NUMBER>(values[i]);
+			state.stack->rawSet();
+		}
+		state.stack->pop(1);
+	}
+	report("vector<double> to table (per element)", elapsedNs(start, Clock::now()), rounds * length);
+
+	start = Clock::now();
+	for (int round = 0; round < rounds; round++){
+		state.stack->push<const std::vector<double> &>(values);
+		state.stack->pop(1);
+	}
+	report("vector<double> to table (bulk)", elapsedNs(start, Clock::now()), rounds * length);
+
+	state.stack->push<const std::vector<double> &>(values);
+	start = Clock::now();
+	for (int round = 0; round < rounds; round++){
+		values = state.stack->to<std::vector<double>>(-1);
+	}
+	report("table to vector<double> (bulk)", elapsedNs(start, Clock::now()), rounds * length);
+	state.stack->pop(1);
+}
+
+/*
+	Sum of a numeric array - Lua loop over a table, Lua loop over a buffer and buffer kernel
+*/
+static void benchmarkBuffers(const int iterations){
+	State state;
+	state.openLibs();
+	state.registerInterface<LuaBufferF64>("f64");
+	state.stack->setGlobal("f64");
+	const int length = 10000;
+	const int rounds = std::max(1, iterations / length);
+	state.loadString("local n = ...; t = {} for i = 1, n do t[i] = i * 0.5 end; buf = f64(t)");
+	state.stack->push<int>(length);
+	state.stack->call(1, 0);
+
+	report("array sum (Lua loop, table)", runScript(state, "local n, t = ..., t; for r = 1, n do local s = 0 for i = 1, #t do s = s + t[i] end end", rounds), rounds * length);
+	report("array sum (Lua loop, buffer)", runScript(state, "local n, b = ..., buf; for r = 1, n do local s = 0 for i = 1, #b do s = s + b[i] end end", rounds), rounds * length);
+	report("array sum (buffer kernel)", runScript(state, "local n, b = ..., buf; for r = 1, n do local s = b:sum() end", rounds), rounds * length);
+	report("array dot (buffer kernel)", runScript(state, "local n, b = ..., buf; for r = 1, n do local s = b:dot(b) end", rounds), rounds * length);
+}
+
+/*
+	Element-wise and reduction kernels over f32 buffers at every supported instruction set vs Lua loops
+*/
+static void benchmarkKernels(const int iterations){
+	State state;
+	state.openLibs();
+	state.registerInterface<LuaBufferF32>("f32");
+	state.stack->setGlobal("f32");
+	KernelLib::open(state);
+	state.stack->pop(1);
+	const int length = 10000;
+	const int rounds = std::max(1, iterations / length);
+	state.loadString("local n = ...; a, b, c = f32(n), f32(n), f32(n); for i = 1, n do a[i] = i % 17; b[i] = i % 5 end; ta, tb, tc = a:toTable(), b:toTable(), c:toTable()");
+	state.stack->push<int>(length);
+	state.stack->call(1, 0);
+
+	report("add (Lua loop, tables)", runScript(state, "local n, a, b, c = ..., ta, tb, tc; for r = 1, n do for i = 1, #a do c[i] = a[i] + b[i] end end", rounds), rounds * length);
+	report("min (Lua loop, tables)", runScript(state, "local n, a = ..., ta; for r = 1, n do local m = a[1] for i = 2, #a do local v = a[i] if v < m then m = v end end end", rounds), rounds * length);
+
+	for (int level = SimdScalar; level <= Simd::getSupportedLevel(); level++){
+		Simd::setLevel(static_cast<SimdLevel>(level));
+		const std::string suffix = std::string(" (") + Simd::getLevelName(Simd::getLevel()) + ")";
+		report(("add kernel" + suffix).c_str(), runScript(state, "local n, add, a, b, c = ..., kernels.add, a, b, c; for r = 1, n do add(c, a, b) end", rounds), rounds * length);
+		report(("fma kernel" + suffix).c_str(), runScript(state, "local n, fma, a, b, c = ..., kernels.fma, a, b, c; for r = 1, n do fma(c, a, b, c) end", rounds), rounds * length);
+		report(("min kernel" + suffix).c_str(), runScript(state, "local n, min, a = ..., kernels.min, a; for r = 1, n do min(a) end", rounds), rounds * length);
+		report(("clamp kernel" + suffix).c_str(), runScript(state, "local n, clamp, a, c = ..., kernels.clamp, a, c; for r = 1, n do clamp(c, a, 2, 10) end", rounds), rounds * length);
+	}
+	Simd::setLevel(Simd::getSupportedLevel());
+	report("prefix sum kernel", runScript(state, "local n, prefixSum, a, c = ..., kernels.prefixSum, a, c; for r = 1, n do prefixSum(c, a) end", rounds), rounds * length);
+	report("histogram kernel", runScript(state, "local n, histogram, a = ..., kernels.histogram, a; for r = 1, n do histogram(a, 0, 17, 16) end", rounds), rounds * length);
+}
+
+/*
+	Calls of a failing validation function - throwing pcall vs tryCall status
+*/
+static void benchmarkErrorPath(const int iterations){
+	State state;
+	state.openLibs();
+	state.loadString("function validate(v) if type(v) ~= 'number' then error('number expected, got ' .. type(v)) end return v end");
+	state.stack->call(0, 0);
+	const int calls = std::max(1, iterations / 10);
+	size_t failures = 0;
+
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < calls; i++){
+		state.stack->getGlobal("validate");
+		state.stack->push<const char *>("x");
+		try{
+			state.stack->pcall(1, 1);
+			state.stack->pop(1);
+		}catch (std::runtime_error & e){
+			failures++;
+			state.stack->pop(1);
+		}
+	}
+	report("failing call (pcall exception)", elapsedNs(start, Clock::now()), calls);
+
+	start = Clock::now();
+	for (int i = 0; i < calls; i++){
+		state.stack->getGlobal("validate");
+		state.stack->push<const char *>("x");
+		CallResult result = state.stack->tryCall(1, 1);
+		failures += result.message.length() > 0 ? 1 : 0;
+		state.stack->pop(1);
+	}
+	report("failing call (tryCall)", elapsedNs(start, Clock::now()), calls);
+
+	start = Clock::now();
+	for (int i = 0; i < calls; i++){
+		state.stack->getGlobal("validate");
+		state.stack->push<const char *>("x");
+		CallResult result = state.stack->tryCall(1, 1, true);
+		failures += result.traceback.empty() ? 0 : 1;
+		state.stack->pop(1);
+	}
+	report("failing call (traceback captured)", elapsedNs(start, Clock::now()), calls);
+
+	start = Clock::now();
+	for (int i = 0; i < calls; i++){
+		state.stack->getGlobal("validate");
+		state.stack->push<const char *>("x");
+		CallResult result = state.stack->tryCall(1, 1, true);
+		failures += result.traceback.str().empty() ? 0 : 1;
+		state.stack->pop(1);
+	}
+	report("failing call (traceback formatted)", elapsedNs(start, Clock::now()), calls);
+
+	// eager formatting with debug.traceback as message handler
+	start = Clock::now();
+	for (int i = 0; i < calls; i++){
+		state.stack->getGlobal("debug");
+		state.stack->getField("traceback", -1);
+		state.stack->remove(-2);
+		state.stack->getGlobal("validate");
+		state.stack->push<const char *>("x");
+		if (lua_pcall(state.state, 1, 1, -3) != 0){
+			failures++;
+		}
+		state.stack->pop(2);
+	}
+	report("failing call (debug.traceback handler)", elapsedNs(start, Clock::now()), calls);
+
+	start = Clock::now();
+	for (int i = 0; i < calls; i++){
+		state.stack->getGlobal("validate");
+		state.stack->push<int>(i);
+		if (state.stack->tryCall(1, 1)){
+			state.stack->pop(1);
+		}
+	}
+	report("successful call (tryCall)", elapsedNs(start, Clock::now()), calls);
+	if (verbose){
+		printf("failures: %zu\n", failures);
+	}
+}
+
+class Vec3 {
+public:
+	float x, y, z;
+	Vec3(const float x = 0.0f, const float y = 0.0f, const float z = 0.0f) : x(x), y(y), z(z){
+	}
+};
+
+/*
+	Vector interface, objects are either inlined in userdata or allocated on the heap
+*/
+template<bool inlined> class LVec3 : public Object<Vec3> {
+public:
+	explicit LVec3(State * state) : Object<Vec3>(state){
+		LUTOK_PROPERTY("x", &LVec3::getX, &LVec3::nullMethod);
+	}
+	Vec3 * create(const Vec3 & value){
+		if (inlined){
+			return emplace(value);
+		}else{
+			Vec3 * object = new Vec3(value);
+			push(object, true);
+			return object;
+		}
+	}
+	Vec3 * constructor(State & state, bool & managed){
+		Stack * stack = state.stack;
+		return create(Vec3(static_cast<float>(stack->to<LUA_NUMBER>(1)), static_cast<float>(stack->to<LUA_NUMBER>(2)), static_cast<float>(stack->to<LUA_NUMBER>(3))));
+	}
+	void destructor(State & state, Vec3 * object){
+		delete object;
+	}
+	int getX(State & state, Vec3 * object){
+		state.stack->push<LUA_NUMBER>(object->x);
+		return 1;
+	}
+	int operator_add(State & state, Vec3 * a, Vec3 * b){
+		create(Vec3(a->x + b->x, a->y + b->y, a->z + b->z));
+		return 1;
+	}
+	// vector * number
+	int operator_mul(State & state, Vec3 * a, Vec3 * b){
+		const float k = static_cast<float>(state.stack->to<LUA_NUMBER>(2));
+		create(Vec3(a->x * k, a->y * k, a->z * k));
+		return 1;
+	}
+};
+
+static const char * vectorWorkload = "local a, b, n = vec(0, 0, 0), vec(1, 2, 3), ...; for i = 1, n do a = a + b * 0.5 end; return a.x";
+
+static void benchmarkValueObjects(const int iterations){
+	{
+		State state;
+		state.openLibs();
+		state.registerInterface<LVec3<false>>("vec");
+		state.stack->setGlobal("vec");
+		report("vector arithmetic (heap objects)", runScript(state, vectorWorkload, iterations), iterations);
+	}
+	{
+		State state;
+		state.openLibs();
+		state.registerInterface<LVec3<true>>("vec");
+		state.stack->setGlobal("vec");
+		report("vector arithmetic (inlined objects)", runScript(state, vectorWorkload, iterations), iterations);
+	}
+}
+
+/*
+	Script run time without profiler and with sampling profiler at different intervals
+*/
+static void benchmarkSampling(const int iterations){
+	State state;
+	state.openLibs();
+	state.loadString("function inner(i) return (i * 7) % 13 end; function outer(i) local s = 0 for j = 1, 10 do s = s + inner(i + j) end return s end");
+	state.stack->call(0, 0);
+	const char * script = "local n, outer = ..., outer; local s = 0; for i = 1, n do s = s + outer(i) end";
+	const int calls = std::max(1, iterations / 10);
+
+	report("script (no profiler)", runScript(state, script, calls), calls);
+	SamplingProfiler profiler(state);
+	const int intervals[] = {100000, 10000, 1000};
+	for (size_t i = 0; i < sizeof(intervals) / sizeof(intervals[0]); i++){
+		profiler.clear();
+		profiler.start(intervals[i]);
+		const double ns = runScript(state, script, calls);
+		profiler.stop();
+		const std::string name = "script (sampling every " + std::to_string(static_cast<long long>(intervals[i])) + ")";
+		report(name.c_str(), ns, calls);
+		if (verbose){
+			printf("%s: %zu samples, %zu dropped\n", name.c_str(), profiler.getSampleCount(), profiler.getDroppedSamples());
+		}
+	}
+	if (verbose){
+		printf("%s", profiler.getFoldedStacks().c_str());
+	}
+}
+
+#if defined(__linux__)
+static const char * echoWorkload =
+	"local requests, clients = ... "
+	"local loop = eventloop "
+	"local server = loop.listen(0) "
+	"local port = loop.port(server) "
+	"loop.spawn(function() "
+	"	for c = 1, clients do "
+	"		local fd = loop.accept(server) "
+	"		loop.spawn(function() "
+	"			while true do "
+	"				local data = loop.read(fd) "
+	"				if not data then break end "
+	"				loop.write(fd, data) "
+	"			end "
+	"			loop.close(fd) "
+	"		end) "
+	"	end "
+	"	loop.close(server) "
+	"end) "
+	"for c = 1, clients do "
+	"	loop.spawn(function() "
+	"		local fd = assert(loop.connect(port)) "
+	"		for i = 1, requests do "
+	"			loop.write(fd, 'ping') "
+	"			loop.read(fd) "
+	"		end "
+	"		loop.close(fd) "
+	"	end) "
+	"end";
+
+static const char * sleepWorkload = "local rounds, count = ...; for c = 1, count do eventloop.spawn(function() for i = 1, rounds do eventloop.sleep(0.001) end end) end";
+
+/*
+	Loopback echo server and clients as coroutines of one event loop, and many concurrently sleeping coroutines
+*/
+static void benchmarkEventLoop(const int iterations){
+	const int clientCounts[] = {1, 16, 256};
+	for (size_t i = 0; i < sizeof(clientCounts) / sizeof(clientCounts[0]); i++){
+		const int clients = clientCounts[i];
+		const int requests = std::max(1, iterations / 20 / clients);
+		State state;
+		state.openLibs();
+		EventLoop loop(state);
+		loop.open();
+		state.stack->pop(1);
+
+		Clock::time_point start = Clock::now();
+		state.loadString(echoWorkload);
+		state.stack->push<int>(requests);
+		state.stack->push<int>(clients);
+		state.stack->call(2, 0);
+		loop.run();
+		const std::string name = "loopback echo request (" + std::to_string(static_cast<long long>(clients)) + " clients)";
+		report(name.c_str(), elapsedNs(start, Clock::now()), requests * clients);
+	}
+	{
+		const int coroutines = 10000;
+		const int rounds = 5;
+		State state;
+		state.openLibs();
+		EventLoop loop(state);
+		loop.open();
+		state.stack->pop(1);
+
+		Clock::time_point start = Clock::now();
+		state.loadString(sleepWorkload);
+		state.stack->push<int>(rounds);
+		state.stack->push<int>(coroutines);
+		state.stack->call(2, 0);
+		loop.run();
+		report("sleep wake-up (10000 coroutines)", elapsedNs(start, Clock::now()), rounds * coroutines);
+	}
+}
+#endif
+
+struct Benchmark {
+	const char * name;
+	std::function<void(int)> run;
+	bool repeated;
+};
+
+/*
+	Usage: benchmark [iterations] [runs] [filter]
+	Only benchmark groups containing filter in their name are run.
+*/
+int main(int argc, char ** argv){
+	const int iterations = (argc > 1) ? atoi(argv[1]) : 1000000;
+	const int runs = (argc > 2) ? std::max(1, atoi(argv[2])) : 5;
+	const std::string filter = (argc > 3) ? argv[3] : "";
+
+	const Benchmark benchmarks[] = {
+		{"calls", benchmarkFunctionCalls, true},
+		{"strings", benchmarkStringArguments, true},
+		{"methods", benchmarkMethodCalls, true},
+		{"objectPush", benchmarkObjectPush, true},
+		{"valueObjects", benchmarkValueObjects, true},
+		{"errors", benchmarkErrorPath, true},
+		{"buffers", benchmarkBuffers, true},
+		{"kernels", benchmarkKernels, true},
+		{"containers", benchmarkContainers, true},
+		{"soak", soakFunctionPush, false},
+		{"allocators", benchmarkAllocators, true},
+		{"chunkCache", [](int){ benchmarkChunkCache(50); }, true},
+		{"loading", [](int){ benchmarkFileLoading(); }, true},
+		{"statePool", benchmarkStatePool, true},
+		{"sampling", benchmarkSampling, true},
+#if defined(__linux__)
+		{"eventLoop", benchmarkEventLoop, true},
+#endif
+	};
+
+	for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++){
+		const Benchmark & benchmark = benchmarks[i];
+		if (!filter.empty() && std::string(benchmark.name).find(filter) == std::string::npos){
+			continue;
+		}
+		if (!benchmark.repeated){
+			verbose = true;
+			benchmark.run(iterations);
+			continue;
+		}
+		recording = false;
+		verbose = false;
+		benchmark.run(iterations);
+		recording = true;
+		for (int run = 0; run < runs; run++){
+			verbose = (run == runs - 1);
+			benchmark.run(iterations);
+		}
+		recording = false;
+	}
+	printResults();
+	return 0;
+}
@@ -1,7 +1,17 @@
 #include "lutok2/lutok2.hpp"
+#include <thread>
 
 using namespace lutok2;
 
+static int failures = 0;
+
+static void check(const bool condition, const char * what){
+	if (!condition){
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
 int testFun(State & state){
 	state.loadString(
 		"print(\"Hello world from lambda function!\") \
@@ -24,13 +34,26 @@ public:
 	void setValue(const std::string & value){
 		this->value = value;
 	}
+	size_t length() const {
+		return value.length();
+	}
 };
 
+double add(double a, double b){
+	return a + b;
+}
+
+int multiply(int a, int b){
+	return a * b;
+}
+
 class LTestObj : public Object<TestObj> {
 public:
 	explicit LTestObj(State * state) : Object<TestObj>(state){
 		LUTOK_PROPERTY("value", &LTestObj::getValue, &LTestObj::setValue);
 		LUTOK_METHOD("method", &LTestObj::method);
+		LUTOK_BIND_PROPERTY("boundValue", &TestObj::getValue, &TestObj::setValue);
+		LUTOK_BIND_METHOD("length", &TestObj::length);
 	}
 	TestObj * constructor(State & state, bool & managed){
 		TestObj * obj = nullptr;
@@ -81,14 +104,127 @@ int main(char ** argv, int argc){
 	});
 	state.stack->setGlobal("testing");
 
+	state.stack->bind(&add);
+	state.stack->setGlobal("add");
+	state.stack->push<lua_CFunction>(LUTOK_FUNCTION(&multiply));
+	state.stack->setGlobal("multiply");
+
 	state.registerInterface<LTestObj>("testObj");
 	state.stack->setGlobal("testObj");
 
+	state.registerInterface<LuaBufferF32>("f32");
+	state.stack->setGlobal("f32");
+	Profiler::open(state.state);
+	KernelLib::open(state);
+	state.stack->pop(1);
+	std::vector<float> samples = {0.5f, 1.0f, 1.5f, 2.0f};
+	state.getInterface<LuaBufferF32>()->wrap(samples.data(), samples.size());
+	state.stack->setGlobal("samples");
+
+	std::vector<double> numbers = {1.5, 2.5, 3.5};
+	state.stack->push<const std::vector<double> &>(numbers);
+	state.stack->setGlobal("numbers");
+	std::map<std::string, int> counts = {{"a", 1}, {"b", 2}};
+	state.stack->push<const std::map<std::string, int> &>(counts);
+	state.stack->setGlobal("counts");
+
 	try {
 		state.loadFile("test/test.lua");
-		state.stack->call(0,0);
+		state.stack->pcall(0,0);
+	}catch(std::exception & e){
+		printf("Can't run test file: %s\n", e.what());
+		failures++;
+	}
+
+	state.stack->getGlobal("numbers");
+	numbers = state.stack->to<std::vector<double>>(-1);
+	state.stack->pop(1);
+	check(numbers.size() == 4 && numbers.back() == 6.0, "vector read back from Lua");
+	if (!numbers.empty()){
+		printf("Numbers: %zu items, last %g\n", numbers.size(), numbers.back());
+	}
+
+	{
+		Scheduler scheduler(state);
+		std::vector<std::thread> workers;
+		state.stack->push<Function>([&scheduler, &workers](State & state) -> int {
+			const int value = state.stack->to<int>(1);
+			Scheduler::Ticket ticket = scheduler.park(state);
+			workers.push_back(std::thread([&scheduler, ticket, value](){
+				scheduler.complete(ticket, [value](State & state) -> int {
+					state.stack->push<int>(value * 2);
+					return 1;
+				});
+			}));
+			return scheduler.yield(state);
+		});
+		state.stack->setGlobal("twice");
+		int finished = 0;
+		for (int i = 1; i <= 3; i++){
+			state.loadString("local v = ... coroutine.yield() return twice(v) + twice(v)");
+			state.stack->push<int>(i);
+			scheduler.spawn(1, [i, &finished](Coroutine & coroutine, int status){
+				const int result = coroutine.getState().stack->to<int>(-1);
+				printf("Coroutine %d: status %d, result %d\n", i, status, result);
+				check(status == 0 && result == 4 * i, "scheduled coroutine result");
+				finished++;
+			});
+		}
+		scheduler.run();
+		check(finished == 3, "all scheduled coroutines finished");
+		for (std::vector<std::thread>::iterator iter = workers.begin(); iter != workers.end(); iter++){
+			iter->join();
+		}
+	}
+#if defined(__linux__)
+	{
+		EventLoop loop(state);
+		loop.open();
+		state.stack->pop(1);
+		loop.setErrorHandler([](Coroutine & coroutine, int status){
+			printf("Event loop coroutine error %d: %s\n", status, coroutine.getState().stack->to<const std::string>(-1).c_str());
+			failures++;
+		});
+		try {
+			state.loadString(
+				"local loop = eventloop "
+				"local r, w = loop.pipe() "
+				"loop.spawn(function() pipeData, pipeEnd = loop.read(r), loop.read(r) loop.close(r) end) "
+				"loop.spawn(function() loop.sleep(0.01) assert(loop.write(w, 'hello') == 5) loop.close(w) end) "
+				"assert(not pcall(loop.read, 0), 'plain numbers are not descriptors')"
+				);
+			state.stack->pcall(0, 0);
+		}catch(std::exception & e){
+			printf("Event loop script failed: %s\n", e.what());
+			failures++;
+		}
+		loop.run();
+		state.stack->getGlobal("pipeData");
+		check(state.stack->is<LUA_TSTRING>(-1) && state.stack->to<const std::string>(-1) == "hello", "event loop pipe read");
+		state.stack->getGlobal("pipeEnd");
+		check(state.stack->is<LUA_TNIL>(-1), "event loop end of stream");
+		state.stack->pop(2);
+		check(loop.getWatchCount() == 0 && loop.getTimerCount() == 0, "event loop released descriptors and timers");
+	}
+#endif
+
+	MemoryUsage usage = state.getMemoryUsage();
+	printf("Memory usage: %zu bytes (peak: %zu bytes)\n", usage.live, usage.peak);
+	state.setMemoryLimit(usage.live + 1024 * 1024);
+	bool limitReached = false;
+	try {
+		state.loadString("local t = {} for i = 1, 1e7 do t[i] = i end");
+		state.stack->pcall(0, 0);
 	}catch(std::exception & e){
-		printf("Can't load test file: %s", e.what());
+		printf("Memory limit reached: %s\n", e.what());
+		limitReached = true;
+	}
+	check(limitReached, "memory limit");
+	state.setMemoryLimit(0);
+
+	if (failures > 0){
+		printf("%d checks failed\n", failures);
+		return 1;
 	}
 	return 0;
 }
\ No newline at end of file
@@ -7,5 +7,25 @@ local t3 = t1..t2
 print(t1, type(t1), getmetatable(t1), t1.value)
 print(t2, type(t2), getmetatable(t2), t2.value)
 print(t3, type(t3), getmetatable(t3), t3.value)
+assert(t1.value == 'test1' and t2.value == 'test2' and t3.value == 'test1test2', 'object properties')
 t3.value = "Halelujah!"
-print(t3, type(t3), getmetatable(t3), t3.value, t3.method())
+print(t3, type(t3), getmetatable(t3), t3.value, t3:method())
+assert(t3.value == 'Halelujah!' and t3:method() == 'Hello', 'object property setter and method')
+t3.boundValue = "Bound"
+print(t3.value, t3.boundValue, t3:length())
+assert(t3.value == 'Bound' and t3.boundValue == 'Bound' and t3:length() == 5, 'bound property and method')
+print(add(1.5, 2), multiply(6, 7))
+assert(add(1.5, 2) == 3.5 and multiply(6, 7) == 42, 'bound functions')
+numbers[#numbers + 1] = #numbers + counts.a + counts.b
+print(#numbers, numbers[1], numbers[#numbers])
+assert(#numbers == 4 and numbers[1] == 1.5 and numbers[4] == 6, 'vector and map conversion')
+local b = f32(4)
+b:fill(2)
+b[1] = 4
+print(#b, b[1], b:sum(), b:dot(samples), samples[4])
+assert(#b == 4 and b[1] == 4 and b:sum() == 10 and b:dot(samples) == 11 and samples[4] == 2, 'buffer methods')
+samples:scale(2)
+kernels.add(b, b, samples)
+print(kernels.level(), kernels.min(b), kernels.max(b), kernels.histogram(b, 0, 10, 2)[1])
+assert(kernels.min(b) == 4 and kernels.max(b) == 6 and kernels.histogram(b, 0, 10, 2)[2] == 3, 'kernels')
+print(type(lutok2.stats()))